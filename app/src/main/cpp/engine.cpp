@@ -0,0 +1,3618 @@
+// engine.cpp
+#include "engine.h"
+#include "llama.h"
+#include "ggml-cpu.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <future>
+#include <thread>
+#include <malloc.h>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Global variables for single initialization
+static std::once_flag g_backend_init_flag;
+static std::atomic<bool> g_backend_initialized{false};
+
+static std::atomic<LogSink*> g_log_sink{nullptr};
+
+void set_log_sink(LogSink* sink) {
+    g_log_sink.store(sink);
+}
+
+void log_message(LogLevel level, const char* format, ...) {
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    LogSink* sink = g_log_sink.load();
+    if (sink) {
+        sink->write(level, message);
+        return;
+    }
+    static const char* const LEVEL_NAMES[] = { "I", "W", "E" };
+    fprintf(stderr, "%s %s\n", LEVEL_NAMES[(int) level], message);
+}
+
+// Default context configuration. The context starts at DEFAULT_N_CTX and is
+// grown to fit the prompt plus the generation budget of each request.
+static const int DEFAULT_N_CTX = 512;
+static const int DEFAULT_N_THREADS = 4;
+static const int CTX_GRANULARITY = 256;
+
+// Tokens per llama_decode call (n_batch == n_ubatch). Long prompts are
+// prefilled in chunks of this size, which bounds the compute buffer.
+static const int PREFILL_CHUNK = 512;
+
+// Generation budget per prompt
+static const int MAX_GEN_TOKENS = 32; // Reduced from 64 for stability
+
+// Streaming jobs hand partial output to the JVM after this many new tokens
+// or this much time, whichever comes first
+static const int STREAM_EVERY_TOKENS = 4;
+static const long STREAM_EVERY_MS = 100;
+
+// Finished jobs whose results nobody awaits are forgotten after this long
+static const long JOB_RESULT_TTL_MS = 5 * 60 * 1000;
+
+// Sequence layout: the shared system-prompt prefix lives in its own sequence
+// and is forked into one working sequence per prompt being decoded
+static const llama_seq_id PREFIX_SEQ_ID = 0;
+static const llama_seq_id FIRST_WORK_SEQ_ID = 1;
+static const int MAX_PARALLEL_SEQS = 8;
+
+// Scoring mode uses one prompt sequence plus one probe sequence per allergen
+static const int N_SEQ_MAX = FIRST_WORK_SEQ_ID + std::max(MAX_PARALLEL_SEQS, 1 + N_ALLERGENS);
+
+// Output grammar for allergen extraction: a comma-separated list of the nine
+// target labels, or EMPTY when none are present
+static const char* ALLERGEN_GRAMMAR = R"GBNF(
+root     ::= list | "EMPTY"
+list     ::= allergen (", " allergen)*
+allergen ::= "milk" | "egg" | "peanut" | "tree nut" | "wheat" | "soy" | "fish" | "shellfish" | "sesame"
+)GBNF";
+
+// Constrain generation with ALLERGEN_GRAMMAR (set through InferenceEngine)
+static std::atomic<bool> g_grammar_enabled{false};
+
+// Residency policy of models loaded from now on
+static std::mutex g_residency_mutex;
+static ResidencyPolicy g_residency_policy;
+
+static ResidencyPolicy residency_policy() {
+    std::lock_guard<std::mutex> lock(g_residency_mutex);
+    return g_residency_policy;
+}
+
+// KV cache element type of new contexts; pooled contexts switch at checkout
+static std::atomic<int> g_kv_cache_type{KV_CACHE_F16};
+
+const char* kv_cache_type_name(KvCacheType type) {
+    switch (type) {
+        case KV_CACHE_Q8_0: return "q8_0";
+        case KV_CACHE_Q4_0: return "q4_0";
+        default: return "f16";
+    }
+}
+
+static ggml_type kv_ggml_type(KvCacheType type) {
+    switch (type) {
+        case KV_CACHE_Q8_0: return GGML_TYPE_Q8_0;
+        case KV_CACHE_Q4_0: return GGML_TYPE_Q4_0;
+        default: return GGML_TYPE_F16;
+    }
+}
+
+// Shortest common prefix worth caching (shorter prefixes are cheap to re-prefill)
+static const int MIN_PREFIX_TOKENS = 32;
+
+// Prompts are split right after this text into the cached prefix (system
+// message and template) and the per-item suffix; see tokenize_prompt()
+static std::mutex g_boundary_mutex;
+static std::string g_prefix_boundary = "Ingredients to analyze:\n";
+
+// Default byte budget for resident models (evicted LRU when exceeded)
+static const uint64_t DEFAULT_MODEL_BUDGET_BYTES = 4ULL * 1024 * 1024 * 1024;
+
+// Max frequency of a CPU in kHz, 0 when cpufreq does not expose it
+static long cpu_max_freq_khz(int cpu) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    long khz = 0;
+    if (fscanf(f, "%ld", &khz) != 1) {
+        khz = 0;
+    }
+    fclose(f);
+    return khz;
+}
+
+// Return freed native heap pages to the system
+static void release_free_heap() {
+#if defined(M_PURGE)
+    mallopt(M_PURGE, 0);
+#elif defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+// Current and peak resident set size from /proc/self/status, in bytes
+static void process_rss_bytes(uint64_t* rss, uint64_t* peak) {
+    *rss = 0;
+    *peak = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %llu kB", &kb) == 1) {
+            *rss = kb * 1024;
+        } else if (sscanf(line, "VmHWM: %llu kB", &kb) == 1) {
+            *peak = kb * 1024;
+        }
+    }
+    fclose(f);
+}
+
+// Name the kernel shows for mappings of `path`: the canonical path, which
+// also resolves /proc/self/fd links to the file behind them
+static std::string mapped_name(const std::string& path) {
+    char resolved[PATH_MAX];
+    return realpath(path.c_str(), resolved) ? std::string(resolved) : path;
+}
+
+// Size, resident and locked bytes of every mapping of `path`, from
+// /proc/self/smaps. For an mmap'd model this is how much of the weights is
+// actually in RAM.
+struct MappingStats {
+    uint64_t size_bytes = 0;
+    uint64_t resident_bytes = 0;
+    uint64_t locked_bytes = 0;
+};
+
+static MappingStats file_mapping_stats(const std::string& path) {
+    MappingStats stats;
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return stats;
+    }
+    const std::string name = mapped_name(path);
+    char line[4096];
+    bool in_mapping = false;
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        // Mapping headers start with "<start>-<end> "; attribute lines with "Name:"
+        unsigned long long start = 0, end = 0;
+        if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            size_t len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' ')) line[--len] = '\0';
+            in_mapping = len >= name.size() && name.compare(0, name.size(), line + len - name.size()) == 0;
+        } else if (!in_mapping) {
+            continue;
+        } else if (sscanf(line, "Size: %llu kB", &kb) == 1) {
+            stats.size_bytes += kb * 1024;
+        } else if (sscanf(line, "Rss: %llu kB", &kb) == 1) {
+            stats.resident_bytes += kb * 1024;
+        } else if (sscanf(line, "Locked: %llu kB", &kb) == 1) {
+            stats.locked_bytes += kb * 1024;
+        }
+    }
+    fclose(f);
+    return stats;
+}
+
+// Address ranges of every mapping of `path`, from /proc/self/maps
+static std::vector<std::pair<uintptr_t, uintptr_t>> file_mappings(const std::string& path) {
+    std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+    FILE* f = fopen("/proc/self/maps", "r");
+    if (!f) {
+        return ranges;
+    }
+    const std::string name = mapped_name(path);
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long start = 0, end = 0;
+        if (sscanf(line, "%llx-%llx ", &start, &end) != 2) continue;
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' ')) line[--len] = '\0';
+        if (len >= name.size() && name.compare(0, name.size(), line + len - name.size()) == 0) {
+            ranges.emplace_back((uintptr_t) start, (uintptr_t) end);
+        }
+    }
+    fclose(f);
+    return ranges;
+}
+
+// MemAvailable from /proc/meminfo, in bytes
+static uint64_t available_memory_bytes() {
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    uint64_t bytes = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            bytes = kb * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return bytes;
+}
+
+// Per-context performance settings, picked by the auto-tuner for each
+// (model, CPU) pair. Thread counts of 0 use the threadpool defaults.
+struct ContextConfig {
+    int n_decode_threads = 0;
+    int n_prefill_threads = 0;
+    int n_ubatch = PREFILL_CHUNK;  // also n_batch: one ubatch per llama_decode
+    llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
+    KvCacheType kv_cache = KV_CACHE_F16; // an app setting, so not persisted with the tuning
+
+    bool operator==(const ContextConfig& o) const {
+        return n_decode_threads == o.n_decode_threads && n_prefill_threads == o.n_prefill_threads &&
+               n_ubatch == o.n_ubatch && flash_attn == o.flash_attn && kv_cache == o.kv_cache;
+    }
+    bool operator!=(const ContextConfig& o) const { return !(*this == o); }
+
+    std::string to_string() const {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "decode=%d prefill=%d ubatch=%d flash=%d",
+                 n_decode_threads, n_prefill_threads, n_ubatch, (int) flash_attn);
+        return buf;
+    }
+
+    bool parse(const char* text) {
+        int flash = 0;
+        ContextConfig c;
+        if (sscanf(text, "decode=%d prefill=%d ubatch=%d flash=%d",
+                   &c.n_decode_threads, &c.n_prefill_threads, &c.n_ubatch, &flash) != 4 ||
+            c.n_ubatch <= 0 || flash < LLAMA_FLASH_ATTN_TYPE_AUTO || flash > LLAMA_FLASH_ATTN_TYPE_ENABLED) {
+            return false;
+        }
+        c.flash_attn = (llama_flash_attn_type) flash;
+        *this = c;
+        return true;
+    }
+};
+
+// Persistent ggml threadpools, organised in lanes. A lane is the unit of
+// concurrency: every in-flight request checks one out, and its context only
+// runs on that lane's cores, so concurrent requests never share workers.
+// Within a lane, single-token decode runs on the lane's performance cores,
+// pinned one thread per core, because threads landing on efficiency cores
+// make every barrier wait for the slowest core; prefill (multi-token
+// ubatches) may use the lane's share of all cores. Pools are paused while
+// their lane is idle so workers do not keep polling.
+class ThreadPools {
+private:
+    struct Lane {
+        ggml_threadpool* decode = nullptr;
+        ggml_threadpool* prefill = nullptr;
+        int n_decode = 0;       // pool sizes
+        int n_prefill = 0;
+        int default_decode = 0;
+        bool busy = false;
+        bool preemptible = false; // held by work that yields to requests (tuning)
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Lane> m_lanes;
+    std::deque<std::atomic<bool>> m_preempt; // per lane: a request is waiting for it
+    int m_n_lanes = 1;
+    int m_req_decode = 0;   // requested threads per lane, 0 = auto
+    int m_req_prefill = 0;
+    bool m_built = false;
+    bool m_reconfiguring = false;
+
+    ThreadPools() = default;
+
+    static ggml_threadpool* create_pool(const std::vector<int>& cpus, int n_threads, bool strict) {
+        ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+        for (int cpu : cpus) {
+            if (cpu < GGML_MAX_N_THREADS) params.cpumask[cpu] = true;
+        }
+        params.strict_cpu = strict;
+        params.paused = true;
+        return ggml_threadpool_new(&params);
+    }
+
+    // The i-th of k contiguous shares of `cores` (one core, shared, if there are fewer cores than lanes)
+    static std::vector<int> share(const std::vector<int>& cores, int i, int k) {
+        const size_t n = cores.size();
+        if (n < (size_t) k) {
+            return { cores[i % n] };
+        }
+        return std::vector<int>(cores.begin() + i * n / k, cores.begin() + (i + 1) * n / k);
+    }
+
+    void build_locked() {
+        if (m_built) {
+            return;
+        }
+        m_built = true;
+
+        // big.LITTLE: every core faster than the slowest cluster counts as a
+        // performance core; on homogeneous or unknown layouts all cores do
+        const int n_cpus = std::max(1, (int) sysconf(_SC_NPROCESSORS_CONF));
+        std::vector<long> freq(n_cpus);
+        long min_freq = 0;
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            freq[cpu] = cpu_max_freq_khz(cpu);
+            if (freq[cpu] > 0 && (min_freq == 0 || freq[cpu] < min_freq)) min_freq = freq[cpu];
+        }
+
+        std::vector<int> all_cores;
+        std::vector<int> perf_cores;
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            all_cores.push_back(cpu);
+            if (freq[cpu] > min_freq) perf_cores.push_back(cpu);
+        }
+        if (perf_cores.empty()) {
+            perf_cores = all_cores;
+        }
+
+        m_lanes.assign(m_n_lanes, Lane());
+        m_preempt.clear();
+        for (int i = 0; i < m_n_lanes; i++) {
+            m_preempt.emplace_back(false);
+        }
+        for (int i = 0; i < m_n_lanes; i++) {
+            Lane& lane = m_lanes[i];
+            const std::vector<int> decode_cores = share(perf_cores, i, m_n_lanes);
+            const std::vector<int> prefill_cores = share(all_cores, i, m_n_lanes);
+
+            // Pools span every core of the share so tuned configs can use fewer
+            // threads per context without rebuilding them
+            lane.n_decode = m_req_decode > 0 ? std::min(m_req_decode, (int) decode_cores.size())
+                                             : (int) decode_cores.size();
+            lane.n_prefill = m_req_prefill > 0 ? std::min(m_req_prefill, (int) prefill_cores.size())
+                                               : (int) prefill_cores.size();
+            lane.default_decode = m_req_decode > 0 ? lane.n_decode : std::min(lane.n_decode, DEFAULT_N_THREADS);
+
+            lane.decode = create_pool(decode_cores, lane.n_decode, true);
+            lane.prefill = create_pool(prefill_cores, lane.n_prefill, false);
+            if (!lane.decode || !lane.prefill) {
+                LOG_ERROR("Failed to create threadpools for lane %d, falling back to per-context threads", i);
+                free_lane(lane);
+                continue;
+            }
+            LOG_INFO("Lane %d: decode %d threads on %zu performance cores, prefill %d threads on %zu cores",
+                     i, lane.n_decode, decode_cores.size(), lane.n_prefill, prefill_cores.size());
+        }
+    }
+
+    static void free_lane(Lane& lane) {
+        if (lane.decode) {
+            ggml_threadpool_free(lane.decode);
+            lane.decode = nullptr;
+        }
+        if (lane.prefill) {
+            ggml_threadpool_free(lane.prefill);
+            lane.prefill = nullptr;
+        }
+    }
+
+    void release_locked() {
+        for (auto& lane : m_lanes) {
+            free_lane(lane);
+        }
+        m_lanes.clear();
+        m_built = false;
+    }
+
+public:
+    static ThreadPools& instance() {
+        static ThreadPools pools;
+        return pools;
+    }
+
+    ~ThreadPools() {
+        release_locked();
+    }
+
+    // Set the number of lanes and the thread counts per lane (0 = auto).
+    // Waits for in-flight requests; pools are rebuilt on next use.
+    void configure(int n_lanes, int n_decode, int n_prefill) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return !m_reconfiguring; });
+        m_reconfiguring = true;
+        m_cv.wait(lock, [this] {
+            return std::none_of(m_lanes.begin(), m_lanes.end(), [](const Lane& l) { return l.busy; });
+        });
+
+        release_locked();
+        m_n_lanes = std::max(n_lanes, 1);
+        m_req_decode = std::max(n_decode, 0);
+        m_req_prefill = std::max(n_prefill, 0);
+
+        m_reconfiguring = false;
+        m_cv.notify_all();
+    }
+
+    int n_lanes() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_n_lanes;
+    }
+
+    // Block until a lane is free, then resume its pools and return its index.
+    // A request that has to wait raises the preempt flag of every lane held
+    // by `preemptible` work, which gives the lane up at its next check; the
+    // flag is cleared when the lane is handed out again.
+    int acquire_lane(bool preemptible = false) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        int idx = -1;
+        m_cv.wait(lock, [this, &idx, preemptible] {
+            if (m_reconfiguring) return false;
+            build_locked();
+            for (size_t i = 0; i < m_lanes.size(); i++) {
+                if (!m_lanes[i].busy) {
+                    idx = (int) i;
+                    return true;
+                }
+            }
+            if (!preemptible) {
+                for (size_t i = 0; i < m_lanes.size(); i++) {
+                    if (m_lanes[i].preemptible) m_preempt[i].store(true);
+                }
+            }
+            return false;
+        });
+
+        Lane& lane = m_lanes[idx];
+        lane.busy = true;
+        lane.preemptible = preemptible;
+        m_preempt[idx].store(false);
+        if (lane.decode) ggml_threadpool_resume(lane.decode);
+        if (lane.prefill) ggml_threadpool_resume(lane.prefill);
+        return idx;
+    }
+
+    void release_lane(int idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Lane& lane = m_lanes[idx];
+        if (lane.decode) ggml_threadpool_pause(lane.decode);
+        if (lane.prefill) ggml_threadpool_pause(lane.prefill);
+        lane.busy = false;
+        lane.preemptible = false;
+        m_cv.notify_all();
+    }
+
+    // Raised while a request waits for lane `idx`; stable until the next
+    // configure(), which cannot run while the lane is held
+    const std::atomic<bool>* preempt_flag(int idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return &m_preempt[idx];
+    }
+
+    // Route ctx's graph computation through the pools of a lane the caller
+    // holds, using the thread counts of `cfg` clamped to the pool sizes
+    void attach(llama_context* ctx, const ContextConfig& cfg, int idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!ctx || idx < 0 || idx >= (int) m_lanes.size() || !m_lanes[idx].decode) {
+            return;
+        }
+        const Lane& lane = m_lanes[idx];
+        const int n_decode = cfg.n_decode_threads > 0 ? std::min(cfg.n_decode_threads, lane.n_decode) : lane.default_decode;
+        const int n_prefill = cfg.n_prefill_threads > 0 ? std::min(cfg.n_prefill_threads, lane.n_prefill) : lane.n_prefill;
+        llama_set_n_threads(ctx, n_decode, n_prefill);
+        llama_attach_threadpool(ctx, lane.decode, lane.prefill);
+    }
+
+    // Pool sizes of a lane, for the tuner's thread-count grid (0 when unavailable)
+    int n_decode(int idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return idx >= 0 && idx < (int) m_lanes.size() && m_lanes[idx].decode ? m_lanes[idx].n_decode : 0;
+    }
+    int n_prefill(int idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return idx >= 0 && idx < (int) m_lanes.size() && m_lanes[idx].prefill ? m_lanes[idx].n_prefill : 0;
+    }
+};
+
+// Simple RAII wrapper for llama_model
+using LoadProgress = std::function<bool(float progress)>;
+
+class LlamaModel {
+private:
+    llama_model* m_model;
+    std::string m_path;
+
+    // Lock the weights in RAM only when the policy asks for it, they leave
+    // at least as much memory available again, and RLIMIT_MEMLOCK allows it
+    static bool should_lock(const char* path) {
+        if (!residency_policy().lock_if_fits) {
+            return false;
+        }
+        struct stat st{};
+        struct rlimit limit{};
+        const uint64_t size = stat(path, &st) == 0 ? (uint64_t) st.st_size : 0;
+        const uint64_t available = available_memory_bytes();
+        if (size == 0 || size * 2 > available) {
+            LOG_INFO("Not locking model weights: %llu bytes, %llu available",
+                     (unsigned long long) size, (unsigned long long) available);
+            return false;
+        }
+        if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_max != RLIM_INFINITY && limit.rlim_max < size) {
+            LOG_INFO("Not locking model weights: RLIMIT_MEMLOCK is %llu bytes", (unsigned long long) limit.rlim_max);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    // `on_progress` gets the load fraction and returns false to abort the load
+    explicit LlamaModel(const char* model_path, const LoadProgress& on_progress = nullptr)
+            : m_model(nullptr), m_path(model_path) {
+        llama_model_params model_params = llama_model_default_params();
+        model_params.n_gpu_layers = 0; // Set to 0 for CPU-only on Android
+        model_params.use_mlock = should_lock(model_path);
+        if (on_progress) {
+            model_params.progress_callback = [](float progress, void* data) {
+                return (*static_cast<const LoadProgress*>(data))(progress);
+            };
+            model_params.progress_callback_user_data = const_cast<LoadProgress*>(&on_progress);
+        }
+        m_model = llama_model_load_from_file(model_path, model_params);
+
+        if (!m_model) {
+            LOG_ERROR("Failed to load model: %s", model_path);
+        } else {
+            LOG_INFO("Model loaded: %s (%llu bytes)", model_path,
+                     (unsigned long long) llama_model_size(m_model));
+        }
+    }
+
+    ~LlamaModel() {
+        if (m_model) {
+            llama_model_free(m_model);
+            LOG_INFO("Model freed");
+        }
+    }
+
+    operator bool() const { return m_model != nullptr; }
+
+    llama_model* get() { return m_model; }
+    const std::string& path() const { return m_path; }
+    uint64_t size_bytes() const { return m_model ? llama_model_size(m_model) : 0; }
+
+    // Disable copy
+    LlamaModel(const LlamaModel&) = delete;
+    LlamaModel& operator=(const LlamaModel&) = delete;
+};
+
+// Simple RAII wrapper for llama_context (does not own the model)
+class LlamaContext {
+private:
+    llama_context* m_ctx;
+    llama_batch m_batch{};  // reused by every decode on this context
+    int m_batch_capacity = 0;
+    ContextConfig m_config;
+    const std::atomic<bool>* m_abort = nullptr; // checked by ggml between graph nodes
+    int m_lane = -1;                            // threadpool lane, -1 when not leased
+
+    static bool abort_requested(void* data) {
+        return static_cast<const std::atomic<bool>*>(data)->load(std::memory_order_relaxed);
+    }
+
+    void init(llama_model* model, int n_ctx) {
+        if (!model) {
+            return;
+        }
+
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = n_ctx;
+        ctx_params.n_threads = m_config.n_decode_threads > 0 ? m_config.n_decode_threads : DEFAULT_N_THREADS;
+        ctx_params.n_threads_batch = m_config.n_prefill_threads > 0 ? m_config.n_prefill_threads : DEFAULT_N_THREADS;
+        ctx_params.n_batch = m_config.n_ubatch;
+        ctx_params.n_ubatch = m_config.n_ubatch;
+        ctx_params.flash_attn_type = m_config.flash_attn;
+        ctx_params.type_k = kv_ggml_type(m_config.kv_cache);
+        ctx_params.type_v = ctx_params.type_k;
+        if (m_config.kv_cache != KV_CACHE_F16) {
+            // llama only supports a quantized V cache with flash attention
+            ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        }
+        ctx_params.n_seq_max = N_SEQ_MAX;
+        ctx_params.kv_unified = true; // forked sequences share the prefix cells
+        ctx_params.no_perf = false;   // keep llama_perf_context counters for the timing report
+
+        m_ctx = llama_init_from_model(model, ctx_params);
+        if (!m_ctx) {
+            LOG_ERROR("Failed to create context");
+        } else {
+            LOG_INFO("Context created successfully with n_ctx=%d (KV %s)", n_ctx, kv_cache_type_name(m_config.kv_cache));
+#ifdef ENGINE_MEMORY_BREAKDOWN
+            // Per-device KV, compute and output buffer sizes. llama.cpp only
+            // prints them; this version has no API that returns them, so they
+            // are not part of MemoryStats (cmake -DENGINE_MEMORY_BREAKDOWN=ON)
+            llama_memory_breakdown_print(m_ctx);
+#endif
+            m_batch_capacity = (int) llama_n_ubatch(m_ctx);
+            m_batch = llama_batch_init(m_batch_capacity, 0, 1);
+            ThreadPools::instance().attach(m_ctx, m_config, m_lane);
+            set_abort_flag(m_abort);
+        }
+    }
+
+    void release() {
+        if (m_batch.token) {
+            llama_batch_free(m_batch);
+            m_batch = {};
+            m_batch_capacity = 0;
+        }
+        if (m_ctx) {
+            llama_free(m_ctx);
+            m_ctx = nullptr;
+            LOG_INFO("Context freed");
+        }
+    }
+
+public:
+    LlamaContext(llama_model* model, int n_ctx, const ContextConfig& config)
+            : m_ctx(nullptr), m_config(config) {
+        init(model, n_ctx);
+    }
+
+    ~LlamaContext() {
+        release();
+    }
+
+    // Replace the context with a new one of a different size
+    bool recreate(llama_model* model, int n_ctx) {
+        release();
+        init(model, n_ctx);
+        return m_ctx != nullptr;
+    }
+
+    // Replace the context with one using `config`, keeping its size
+    bool reconfigure(llama_model* model, const ContextConfig& config) {
+        const int n = std::max(n_ctx(), DEFAULT_N_CTX);
+        m_config = config;
+        return recreate(model, n);
+    }
+
+    const ContextConfig& config() const { return m_config; }
+
+    // Run on the threadpools of `lane` (held by the caller). Survives recreate().
+    void bind_lane(int lane) {
+        m_lane = lane;
+        ThreadPools::instance().attach(m_ctx, m_config, lane);
+    }
+
+    // While `flag` is set, llama_decode aborts and returns 2. Survives recreate().
+    void set_abort_flag(const std::atomic<bool>* flag) {
+        m_abort = flag;
+        if (m_ctx) {
+            llama_set_abort_callback(m_ctx, flag ? abort_requested : nullptr, (void*) flag);
+        }
+    }
+
+    operator bool() const { return m_ctx != nullptr; }
+
+    llama_context* get() { return m_ctx; }
+    int n_ctx() const { return m_ctx ? (int) llama_n_ctx(m_ctx) : 0; }
+
+    // The context's preallocated batch, emptied for reuse
+    llama_batch& batch() {
+        m_batch.n_tokens = 0;
+        return m_batch;
+    }
+    int batch_capacity() const { return m_batch_capacity; }
+
+    // Drop all cached tokens so the context can serve a new request
+    void clear() {
+        if (m_ctx) {
+            llama_memory_clear(llama_get_memory(m_ctx), true);
+        }
+    }
+
+    // Drop the cached tokens of a single sequence
+    void clear_seq(llama_seq_id seq_id) {
+        if (m_ctx) {
+            llama_memory_seq_rm(llama_get_memory(m_ctx), seq_id, -1, -1);
+        }
+    }
+
+    // Disable copy
+    LlamaContext(const LlamaContext&) = delete;
+    LlamaContext& operator=(const LlamaContext&) = delete;
+};
+
+static void batch_add(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    const int i = batch.n_tokens++;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.seq_id[i][0] = seq_id;
+    batch.n_seq_id[i] = 1;
+    batch.logits[i] = logits;
+}
+
+// Decode `count` tokens into `seq_id` starting at position `pos0`, in chunks
+// of the context's batch. Logits are requested for the last token only when
+// `want_logits` is set.
+static int decode_tokens(
+        LlamaContext& ctx,
+        const llama_token* tokens,
+        int count,
+        int pos0,
+        llama_seq_id seq_id,
+        bool want_logits) {
+
+    llama_batch& batch = ctx.batch();
+    const int capacity = ctx.batch_capacity();
+
+    for (int start = 0; start < count; start += capacity) {
+        const int end = std::min(count, start + capacity);
+
+        batch.n_tokens = 0;
+        for (int i = start; i < end; i++) {
+            batch_add(batch, tokens[i], pos0 + i, seq_id, want_logits && (i == count - 1));
+        }
+
+        int result = llama_decode(ctx.get(), batch);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    batch.n_tokens = 0;
+    return 0;
+}
+
+// 64-bit FNV-1a, used to key the on-disk caches
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string to_hex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) value);
+    return buf;
+}
+
+// Cheap identity of a model file: its size plus the first and last MiB,
+// which cover the GGUF header, metadata and the tail of the tensor data
+static uint64_t model_fingerprint(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return 0;
+    }
+
+    const size_t window = 1024 * 1024;
+    std::vector<uint8_t> buf(window);
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    uint64_t hash = fnv1a(&size, sizeof(size));
+
+    fseek(f, 0, SEEK_SET);
+    hash = fnv1a(buf.data(), fread(buf.data(), 1, window, f), hash);
+
+    if (size > (long) window) {
+        fseek(f, size - (long) window, SEEK_SET);
+        hash = fnv1a(buf.data(), fread(buf.data(), 1, window, f), hash);
+    }
+
+    fclose(f);
+    return hash;
+}
+
+// Identity of the CPU a tuned config was measured on: core count, per-core
+// max frequencies and the SIMD features ggml dispatches on
+static uint64_t cpu_signature() {
+    static const uint64_t signature = [] {
+        const int n_cpus = std::max(1, (int) sysconf(_SC_NPROCESSORS_CONF));
+        uint64_t hash = fnv1a(&n_cpus, sizeof(n_cpus));
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            long khz = cpu_max_freq_khz(cpu);
+            hash = fnv1a(&khz, sizeof(khz), hash);
+        }
+        const int features[] = {
+                ggml_cpu_has_neon(), ggml_cpu_has_dotprod(), ggml_cpu_has_matmul_int8(),
+                ggml_cpu_has_sve(), ggml_cpu_has_fp16_va(), ggml_cpu_has_avx2(), ggml_cpu_has_avx512()
+        };
+        return fnv1a(features, sizeof(features), hash);
+    }();
+    return signature;
+}
+
+static bool load_context_config(const std::string& path, ContextConfig& config) {
+    if (path.empty()) {
+        return false;
+    }
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    char line[128] = {};
+    bool ok = fgets(line, sizeof(line), f) != nullptr && config.parse(line);
+    fclose(f);
+    return ok;
+}
+
+static bool save_context_config(const std::string& path, const ContextConfig& config) {
+    FILE* f = path.empty() ? nullptr : fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    bool ok = fprintf(f, "%s\n", config.to_string().c_str()) > 0;
+    return fclose(f) == 0 && ok;
+}
+
+// Caches the KV of the prompt prefix shared by consecutive requests (the
+// system message and reference guide) in PREFIX_SEQ_ID. The prefix is
+// discovered as the common token prefix of two consecutive prompts, so it
+// follows whatever chat template the caller used for this model.
+class PrefixCache {
+private:
+    std::vector<llama_token> m_prefix;      // tokens resident in PREFIX_SEQ_ID
+    std::vector<llama_token> m_last_prompt; // previous prompt, to discover the prefix
+    std::string m_state_stem;               // "<dir>/prefix-<model hash>", empty disables persistence
+
+    static size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n]) n++;
+        return n;
+    }
+
+    bool rebuild(LlamaContext& ctx, const std::vector<llama_token>& tokens, size_t n_prefix) {
+        ctx.clear_seq(PREFIX_SEQ_ID);
+        m_prefix.clear();
+
+        if (decode_tokens(ctx, tokens.data(), (int) n_prefix, 0, PREFIX_SEQ_ID, false) != 0) {
+            LOG_WARN("Failed to decode prompt prefix, continuing without cache");
+            ctx.clear_seq(PREFIX_SEQ_ID);
+            return false;
+        }
+
+        m_prefix.assign(tokens.begin(), tokens.begin() + n_prefix);
+        LOG_INFO("Cached prompt prefix of %zu tokens", n_prefix);
+        return true;
+    }
+
+    // The template part of the key is the hash of the first MIN_PREFIX_TOKENS
+    // tokens (chat header and start of the system message)
+    std::string state_path(const std::vector<llama_token>& tokens) const {
+        return m_state_stem + "-" +
+               to_hex(fnv1a(tokens.data(), MIN_PREFIX_TOKENS * sizeof(llama_token))) + ".bin";
+    }
+
+    // Token list at the start of a llama_state_seq_save_file file (magic,
+    // version, token count, tokens). False when the header is unreadable or
+    // from another llama state format.
+    static bool read_state_tokens(const std::string& path, std::vector<llama_token>& tokens) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        uint32_t header[3];
+        bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == LLAMA_STATE_SEQ_MAGIC &&
+                  header[1] == LLAMA_STATE_SEQ_VERSION && header[2] > 0 && header[2] <= (1u << 24);
+        if (ok) {
+            tokens.resize(header[2]);
+            ok = fread(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size();
+        }
+        fclose(f);
+        return ok;
+    }
+
+    // Load a prefix saved by an earlier process. Files that are corrupt,
+    // whose tokens no longer match the prompt (edited system message or
+    // template), or that end anywhere but at the prompt's boundary when it
+    // has one, are deleted. A valid file that this context cannot take (too
+    // small, other lane or config) is only skipped.
+    bool restore(llama_context* ctx, const std::vector<llama_token>& tokens, size_t n_stable, size_t max_reuse) {
+        if (m_state_stem.empty() || tokens.size() < (size_t) MIN_PREFIX_TOKENS) {
+            return false;
+        }
+
+        const std::string path = state_path(tokens);
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+
+        std::vector<llama_token> saved;
+        if (!read_state_tokens(path, saved) || common_prefix(saved, tokens) != saved.size() ||
+            (n_stable > 0 && saved.size() != n_stable)) {
+            LOG_INFO("Discarding stale prompt state: %s", path.c_str());
+            remove(path.c_str());
+            return false;
+        }
+        if (saved.size() > max_reuse || saved.size() >= (size_t) llama_n_ctx(ctx)) {
+            return false;
+        }
+
+        llama_memory_t mem = llama_get_memory(ctx);
+        llama_memory_seq_rm(mem, PREFIX_SEQ_ID, -1, -1);
+        m_prefix.clear();
+
+        std::vector<llama_token> loaded(saved.size());
+        size_t n_loaded = 0;
+        if (llama_state_seq_load_file(ctx, path.c_str(), PREFIX_SEQ_ID, loaded.data(), loaded.size(),
+                                      &n_loaded) == 0 || n_loaded != saved.size()) {
+            LOG_WARN("Prompt state %s does not fit this context, skipping it", path.c_str());
+            llama_memory_seq_rm(mem, PREFIX_SEQ_ID, -1, -1);
+            return false;
+        }
+
+        m_prefix = std::move(saved);
+        LOG_INFO("Restored prompt prefix of %zu tokens from %s", m_prefix.size(), path.c_str());
+        return true;
+    }
+
+    void persist(llama_context* ctx) const {
+        if (m_state_stem.empty()) {
+            return;
+        }
+
+        // Pooled contexts of the same model may persist concurrently; write a
+        // private file and rename it so readers never see a partial state
+        const std::string path = state_path(m_prefix);
+        const std::string tmp = path + "." + to_hex((uint64_t) (uintptr_t) this) + ".tmp";
+        if (llama_state_seq_save_file(ctx, tmp.c_str(), PREFIX_SEQ_ID, m_prefix.data(), m_prefix.size()) == 0 ||
+            rename(tmp.c_str(), path.c_str()) != 0) {
+            LOG_WARN("Failed to save prompt state: %s", path.c_str());
+            remove(tmp.c_str());
+        } else {
+            LOG_INFO("Saved prompt prefix of %zu tokens to %s", m_prefix.size(), path.c_str());
+        }
+    }
+
+public:
+    size_t size() const { return m_prefix.size(); }
+
+    // Whether a prompt with this boundary would attach the cached prefix as is
+    bool matches(const std::vector<llama_token>& tokens, size_t n_stable) const {
+        return !m_prefix.empty() && m_prefix.size() == n_stable && n_stable < tokens.size() &&
+               common_prefix(m_prefix, tokens) == m_prefix.size();
+    }
+
+    void set_state_stem(const std::string& stem) { m_state_stem = stem; }
+
+    // Forks the cached prefix into `seq_id` (which must be empty) and returns
+    // the number of prompt tokens that no longer need to be decoded. The
+    // prefix is the first `n_stable` tokens when the prompt has a boundary
+    // (tokenize_prompt), otherwise the common prefix with the previous prompt.
+    int attach(LlamaContext& ctx, const std::vector<llama_token>& tokens, size_t n_stable, llama_seq_id seq_id) {
+        // At least one token must remain to produce logits for sampling
+        const size_t max_reuse = tokens.empty() ? 0 : tokens.size() - 1;
+
+        bool hit = !m_prefix.empty() && m_prefix.size() <= max_reuse &&
+                   (n_stable == 0 || m_prefix.size() == n_stable) &&
+                   common_prefix(m_prefix, tokens) == m_prefix.size();
+
+        if (!hit) {
+            hit = restore(ctx.get(), tokens, n_stable, max_reuse);
+        }
+
+        if (!hit) {
+            size_t n_common = std::min(n_stable > 0 ? n_stable : common_prefix(m_last_prompt, tokens), max_reuse);
+            hit = n_common >= (size_t) MIN_PREFIX_TOKENS && rebuild(ctx, tokens, n_common);
+            if (hit) {
+                persist(ctx.get());
+            }
+        }
+        m_last_prompt = tokens;
+
+        if (!hit) {
+            return 0;
+        }
+
+        llama_memory_seq_cp(llama_get_memory(ctx.get()), PREFIX_SEQ_ID, seq_id, -1, -1);
+        return (int) m_prefix.size();
+    }
+
+    void reset() {
+        m_prefix.clear();
+        m_last_prompt.clear();
+    }
+};
+
+using Clock = std::chrono::high_resolution_clock;
+
+static long elapsed_ms(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+}
+
+static long elapsed_us(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+// Tokens per second over a microsecond interval; 0 when nothing was timed
+static long tokens_per_second(long n_tokens, long us) {
+    return (us > 0 && n_tokens > 0) ? (long) ((n_tokens * 1000000LL) / us) : 0;
+}
+
+// Nearest-rank p50/p95/max of the inter-token latencies; sorts `samples`
+static void set_itl_percentiles(std::vector<long>& samples, PhaseTimings& t) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    t.itl_p50_us = samples[(n - 1) * 50 / 100];
+    t.itl_p95_us = samples[(n - 1) * 95 / 100];
+    t.itl_max_us = samples[n - 1];
+}
+
+// Copy the context's llama.cpp perf counters into every result of a run
+static void set_perf_timings(llama_context* ctx, std::vector<InferenceResult>& results) {
+    const llama_perf_context_data perf = llama_perf_context(ctx);
+    LOG_INFO("llama perf: prompt %d tokens in %.2f ms, eval %d tokens in %.2f ms, %d graph reuses",
+             perf.n_p_eval, perf.t_p_eval_ms, perf.n_eval, perf.t_eval_ms, perf.n_reused);
+    for (auto& r : results) {
+        r.timings.perf_prompt_us = (long) (perf.t_p_eval_ms * 1000.0);
+        r.timings.perf_eval_us = (long) (perf.t_eval_ms * 1000.0);
+    }
+}
+
+static std::vector<InferenceResult> error_results(size_t n, const std::string& error) {
+    std::vector<InferenceResult> results(n);
+    for (auto& r : results) r.error = error;
+    return results;
+}
+
+int decode_label_mask(const std::string& output) {
+    std::string text(output);
+    for (char& c : text) c = (char) tolower((unsigned char) c);
+
+    auto is_word = [](char c) { return isalnum((unsigned char) c) || c == '_'; };
+    int mask = 0;
+    for (int i = 0; i < N_ALLERGENS; i++) {
+        const size_t len = strlen(ALLERGEN_LABELS[i]);
+        for (size_t pos = text.find(ALLERGEN_LABELS[i]); pos != std::string::npos;
+             pos = text.find(ALLERGEN_LABELS[i], pos + 1)) {
+            if ((pos == 0 || !is_word(text[pos - 1])) &&
+                (pos + len == text.size() || !is_word(text[pos + len]))) {
+                mask |= 1 << i;
+                break;
+            }
+        }
+    }
+    return mask;
+}
+
+// Decoding state of one scheduler slot. A slot owns a working sequence and
+// serves queued prompts one after another.
+struct SequenceState {
+    llama_seq_id seq_id = 0;
+    int item = -1;              // index of the prompt being served, -1 when free
+    const std::vector<llama_token>* tokens = nullptr;
+    llama_sampler* sampler = nullptr;
+    llama_sampler* grammar = nullptr;   // optional output constraint
+    std::vector<llama_token_data> candidates; // scratch for grammar filtering
+    llama_token next_token = 0; // sampled but not yet decoded
+    int n_past = 0;             // tokens stored in the KV cache
+    int n_reused = 0;           // prompt tokens attached from the prefix cache, never prefilled
+    int i_logits = -1;          // batch index holding this sequence's logits
+    bool prefilled = false;
+    bool done = false;
+    Clock::time_point t_admit;
+    Clock::time_point t_prompt_end;
+    Clock::time_point t_last_token;
+    Clock::time_point t_done;
+    std::vector<long> itl_us;   // gaps between consecutive output tokens
+    InferenceResult result;
+
+    // Per-slot totals across every prompt it served
+    int n_served = 0;
+    int n_generated = 0;
+    long busy_ms = 0;
+
+    SequenceState() = default;
+    ~SequenceState() {
+        release();
+        if (sampler) {
+            llama_sampler_free(sampler);
+        }
+    }
+
+    bool busy() const { return item >= 0; }
+    bool generating() const { return busy() && prefilled && !done; }
+
+    void finish() {
+        done = true;
+        t_done = Clock::now();
+    }
+
+    // Free the slot for the next prompt. The greedy sampler is stateless and
+    // is kept; only the per-prompt grammar state is dropped.
+    void release() {
+        if (grammar) {
+            llama_sampler_free(grammar);
+            grammar = nullptr;
+        }
+        item = -1;
+        tokens = nullptr;
+    }
+
+    void reset_stats() {
+        n_served = 0;
+        n_generated = 0;
+        busy_ms = 0;
+    }
+
+    // Disable copy
+    SequenceState(const SequenceState&) = delete;
+    SequenceState& operator=(const SequenceState&) = delete;
+};
+
+// Host-side buffers reused by every request on a model, so steady-state
+// decoding does not allocate: scheduler slots, prompt token vectors and the
+// scoring probes, which only depend on the vocabulary.
+struct DecodeArena {
+    std::vector<SequenceState> slots;
+    std::vector<std::vector<llama_token>> prompt_tokens;
+    std::vector<size_t> prompt_stable; // prefix length of each prompt, from tokenize_prompt()
+
+    bool probes_ready = false;
+    std::vector<llama_token> probe_tokens[N_ALLERGENS];
+    std::vector<llama_token> yes_tokens;
+    std::vector<llama_token> no_tokens;
+
+    DecodeArena() : slots(MAX_PARALLEL_SEQS) {
+        for (int s = 0; s < MAX_PARALLEL_SEQS; s++) {
+            slots[s].seq_id = FIRST_WORK_SEQ_ID + s;
+            slots[s].itl_us.reserve(MAX_GEN_TOKENS);
+        }
+    }
+};
+
+// One context of a model's pool, with the state tied to it: the cached
+// prefix lives in this context's KV cache and the arena serves its decode loop
+struct PooledContext {
+    LlamaModel& model;
+    LlamaContext ctx;
+    PrefixCache prefix;
+    DecodeArena arena;
+    llama_sampler* grammar = nullptr; // compiled once, cloned per request
+    std::string weights_format;       // optimized variant format of the model, empty for the original
+    bool in_use = false;
+    bool release_on_checkin = false;  // trimmed while serving a request
+
+    PooledContext(LlamaModel& m, const ContextConfig& config)
+            : model(m),
+              ctx(m.get(), DEFAULT_N_CTX, config) {}
+
+    ~PooledContext() {
+        if (grammar) {
+            llama_sampler_free(grammar);
+        }
+    }
+
+    // Returns a fresh copy of the allergen grammar sampler, compiling it on first use
+    llama_sampler* clone_grammar() {
+        if (!grammar && model) {
+            grammar = llama_sampler_init_grammar(llama_model_get_vocab(model.get()), ALLERGEN_GRAMMAR, "root");
+            if (!grammar) {
+                LOG_ERROR("Failed to compile allergen grammar");
+                return nullptr;
+            }
+            LOG_INFO("Allergen grammar compiled");
+        }
+        return grammar ? llama_sampler_clone(grammar) : nullptr;
+    }
+
+    // Recreate the context with `cfg`; the cached prefix goes with the old one
+    bool apply_config(const ContextConfig& cfg) {
+        if (ctx && ctx.config() == cfg) {
+            return true;
+        }
+        prefix.reset();
+        return ctx.reconfigure(model.get(), cfg);
+    }
+
+    // Grow the context so it can hold at least `n_tokens` KV cells.
+    // Growing drops the cached prefix together with the old context.
+    bool reserve(int n_tokens) {
+        if (ctx.n_ctx() >= n_tokens) {
+            return true;
+        }
+        int n_ctx = ((n_tokens + CTX_GRANULARITY - 1) / CTX_GRANULARITY) * CTX_GRANULARITY;
+        LOG_INFO("Growing context from %d to %d tokens", ctx.n_ctx(), n_ctx);
+        prefix.reset();
+        return ctx.recreate(model.get(), n_ctx);
+    }
+
+    // Current footprint of the model and this context. Reads /proc, so it is
+    // taken once per run rather than per token.
+    MemoryStats memory_stats() const {
+        MemoryStats m;
+        m.model_bytes = model.size_bytes();
+        m.model_resident_bytes = file_mapping_stats(model.path()).resident_bytes;
+        process_rss_bytes(&m.rss_bytes, &m.peak_rss_bytes);
+        return m;
+    }
+
+    // Disable copy
+    PooledContext(const PooledContext&) = delete;
+    PooledContext& operator=(const PooledContext&) = delete;
+};
+
+// A model kept resident between requests, with a pool of contexts that share
+// its weights. Concurrent requests each check out their own context; the
+// pool grows on demand and is bounded in practice by the threadpool lanes.
+struct LoadedModel {
+    std::string path;
+    uint64_t fingerprint;
+    LlamaModel model;
+    uint64_t last_used = 0;
+    std::atomic<bool> warmed{false}; // a warmup decode has paged in the weights
+    std::string variant_format;      // optimized variant format, empty for the model as given
+
+private:
+    std::mutex m_mutex; // guards everything below
+    std::string m_state_dir;
+    ContextConfig m_config;   // tuned for this model and CPU when available
+    bool m_tuned = false;
+    std::vector<std::unique_ptr<PooledContext>> m_contexts;
+
+    std::string config_path_locked() const {
+        return m_state_dir.empty() ? "" : m_state_dir + "/tune-" + to_hex(fingerprint) + "-" + to_hex(cpu_signature()) + ".cfg";
+    }
+
+    // The tuned config with the current KV cache type
+    ContextConfig effective_config_locked() const {
+        ContextConfig cfg = m_config;
+        cfg.kv_cache = (KvCacheType) g_kv_cache_type.load();
+        return cfg;
+    }
+
+public:
+    LoadedModel(const std::string& model_path, const std::string& dir, const LoadProgress& on_progress,
+                const std::string& format = "")
+            : path(model_path),
+              fingerprint(model_fingerprint(model_path)),
+              model(model_path.c_str(), on_progress),
+              variant_format(format) {
+        set_state_dir(dir);
+        // Create the first context up front so a model that cannot get one is rejected at load
+        if (model) {
+            m_contexts.emplace_back(new PooledContext(model, effective_config_locked()));
+            m_contexts.back()->weights_format = variant_format;
+        }
+    }
+
+    operator bool() const { return model && !m_contexts.empty() && m_contexts[0]->ctx; }
+
+    // Persist prompt prefixes and the tuned config under `dir`, keyed by this
+    // model's fingerprint. Pooled contexts pick the change up at checkout.
+    void set_state_dir(const std::string& dir) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state_dir = dir;
+
+        ContextConfig stored;
+        if (!m_tuned && load_context_config(config_path_locked(), stored)) {
+            LOG_INFO("Using tuned context config: %s", stored.to_string().c_str());
+            m_tuned = true;
+            m_config = stored;
+        }
+    }
+
+    std::string config_path() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return config_path_locked();
+    }
+
+    ContextConfig config(bool* tuned = nullptr) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (tuned) *tuned = m_tuned;
+        return effective_config_locked();
+    }
+
+    void set_tuned_config(const ContextConfig& cfg) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_config = cfg;
+        m_tuned = true;
+    }
+
+    // Take a free context from the pool, creating one if all are in use, and
+    // bring it up to date with settings changed since it was last used
+    PooledContext* checkout() {
+        PooledContext* pc = nullptr;
+        ContextConfig cfg;
+        std::string stem;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& c : m_contexts) {
+                if (!c->in_use) {
+                    pc = c.get();
+                    break;
+                }
+            }
+            cfg = effective_config_locked();
+            if (!pc) {
+                m_contexts.emplace_back(new PooledContext(model, cfg));
+                pc = m_contexts.back().get();
+                pc->weights_format = variant_format;
+                LOG_INFO("Context pool of %s grown to %zu", path.c_str(), m_contexts.size());
+            }
+            pc->in_use = true;
+            // Saved prefix states only fit contexts with the same KV cache type
+            stem = m_state_dir.empty() ? "" : m_state_dir + "/prefix-" + to_hex(fingerprint);
+            if (!stem.empty() && cfg.kv_cache != KV_CACHE_F16) {
+                stem += std::string("-") + kv_cache_type_name(cfg.kv_cache);
+            }
+        }
+
+        pc->prefix.set_state_stem(stem);
+        if (!pc->apply_config(cfg)) {
+            checkin(pc);
+            return nullptr;
+        }
+        return pc;
+    }
+
+    void checkin(PooledContext* pc) {
+        std::unique_ptr<PooledContext> released;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pc->in_use = false;
+            if (pc->release_on_checkin) {
+                for (auto it = m_contexts.begin(); it != m_contexts.end(); ++it) {
+                    if (it->get() == pc) {
+                        released = std::move(*it);
+                        m_contexts.erase(it);
+                        break;
+                    }
+                }
+                LOG_INFO("Released trimmed context of %s", path.c_str());
+            }
+        }
+    }
+
+    // Free idle contexts with their KV caches, compute buffers and cached
+    // prefixes; contexts serving a request follow when checked in. The next
+    // checkout creates a context again and restores the prefix from disk.
+    // Returns the number of contexts freed now.
+    size_t release_contexts() {
+        std::vector<std::unique_ptr<PooledContext>> released;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_contexts.begin(); it != m_contexts.end();) {
+                if ((*it)->in_use) {
+                    (*it)->release_on_checkin = true;
+                    ++it;
+                } else {
+                    released.push_back(std::move(*it));
+                    it = m_contexts.erase(it);
+                }
+            }
+        }
+        return released.size();
+    }
+};
+
+// Brings a model's mmap'd weights into RAM after it loads, so the first
+// decodes do not page-fault across the whole file. WILLNEED asks the
+// kernel to read the mappings ahead; PREFAULT also touches every page on
+// this helper thread. Either way the loading request does not wait.
+class ResidencyManager {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::weak_ptr<LoadedModel>> m_queue;
+    std::thread m_thread;
+    bool m_stop = false;
+
+    static const size_t PREFAULT_CHUNK = 64 << 20;
+
+    // Touch every page of the model's mappings, a chunk at a time, stopping
+    // once the model has been unloaded
+    static void prefault(const std::weak_ptr<LoadedModel>& weak) {
+        std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+        if (auto loaded = weak.lock()) {
+            ranges = file_mappings(loaded->model.path());
+        }
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        for (const auto& range : ranges) {
+            for (uintptr_t chunk = range.first; chunk < range.second; chunk += PREFAULT_CHUNK) {
+                auto loaded = weak.lock(); // keeps the mapping alive while it is touched
+                if (!loaded) {
+                    return;
+                }
+                const size_t len = std::min<size_t>(PREFAULT_CHUNK, range.second - chunk);
+#ifdef MADV_POPULATE_READ
+                if (madvise((void*) chunk, len, MADV_POPULATE_READ) == 0) {
+                    continue;
+                }
+#endif
+                volatile const char* bytes = (const char*) chunk;
+                for (size_t off = 0; off < len; off += page) {
+                    (void) bytes[off];
+                }
+            }
+        }
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) {
+                break;
+            }
+            std::weak_ptr<LoadedModel> weak = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+
+            const auto t_start = Clock::now();
+            prefault(weak);
+            if (auto loaded = weak.lock()) {
+                const MappingStats stats = file_mapping_stats(loaded->model.path());
+                LOG_INFO("Prefaulted %s in %ld ms: %.0f%% resident", loaded->path.c_str(),
+                         elapsed_ms(t_start, Clock::now()),
+                         stats.size_bytes ? 100.0 * stats.resident_bytes / stats.size_bytes : 0.0);
+            }
+
+            lock.lock();
+        }
+    }
+
+public:
+    static ResidencyManager& instance() {
+        static ResidencyManager manager;
+        return manager;
+    }
+
+    ~ResidencyManager() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // Apply the current policy to a freshly loaded model
+    void on_load(const std::shared_ptr<LoadedModel>& loaded) {
+        const ResidencyPolicy policy = residency_policy();
+        if (policy.mode == RESIDENCY_LAZY && !policy.hugepages) {
+            return;
+        }
+
+        for (const auto& range : file_mappings(loaded->model.path())) {
+            void* addr = (void*) range.first;
+            const size_t len = range.second - range.first;
+#ifdef MADV_HUGEPAGE
+            if (policy.hugepages && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+                LOG_WARN("MADV_HUGEPAGE not supported for %s", loaded->path.c_str());
+            }
+#endif
+            if (policy.mode != RESIDENCY_LAZY) {
+                madvise(addr, len, MADV_WILLNEED);
+            }
+        }
+
+        if (policy.mode == RESIDENCY_PREFAULT) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(loaded);
+            if (!m_thread.joinable()) {
+                m_thread = std::thread(&ResidencyManager::loop, this);
+            }
+            m_cv.notify_one();
+        }
+    }
+};
+
+// Exclusive use of one threadpool lane and one pooled context of a model for
+// the duration of a request. This replaces the old process-wide inference
+// mutex: requests only wait when every lane is busy.
+class ContextLease {
+private:
+    std::shared_ptr<LoadedModel> m_model;
+    int m_lane;
+    PooledContext* m_ctx = nullptr;
+
+public:
+    // A `preemptible` lease is asked to give its lane up (preempt_flag())
+    // whenever a regular request has to wait for one
+    explicit ContextLease(std::shared_ptr<LoadedModel> model, bool preemptible = false)
+            : m_model(std::move(model)),
+              m_lane(ThreadPools::instance().acquire_lane(preemptible)) {
+        m_ctx = m_model->checkout();
+        if (m_ctx) {
+            m_ctx->ctx.bind_lane(m_lane);
+        }
+    }
+
+    ~ContextLease() {
+        if (m_ctx) {
+            m_ctx->ctx.set_abort_flag(nullptr);
+            m_model->checkin(m_ctx);
+        }
+        ThreadPools::instance().release_lane(m_lane);
+    }
+
+    explicit operator bool() const { return m_ctx != nullptr; }
+
+    PooledContext& operator*() { return *m_ctx; }
+    PooledContext* operator->() { return m_ctx; }
+    LoadedModel& model() { return *m_model; }
+    int lane() const { return m_lane; }
+    const std::atomic<bool>* preempt_flag() const { return ThreadPools::instance().preempt_flag(m_lane); }
+
+    // Disable copy
+    ContextLease(const ContextLease&) = delete;
+    ContextLease& operator=(const ContextLease&) = delete;
+};
+
+// Device-optimized variants of the bundled models. ggml repacks Q4_0 weights
+// at load into interleaved layouts for the CPU's int8 dot-product (dotprod),
+// matrix-multiply (i8mm) or AVX2 kernels; the K-quants the models ship in
+// have no such path, so on those CPUs a Q4_0 copy decodes faster.
+static std::atomic<bool> g_use_variants{false};
+static std::mutex g_variant_mutex;
+static std::unordered_map<std::string, std::string> g_variants; // model path -> variant path, empty when none
+static std::mutex g_variant_build_mutex;                         // one requantization at a time
+
+// Weight format that beats the bundled K-quants on this CPU, nullptr when none
+static const char* optimized_format(llama_ftype* ftype) {
+    const bool arm_int8 = ggml_cpu_has_neon() && (ggml_cpu_has_dotprod() || ggml_cpu_has_matmul_int8());
+    if (arm_int8 || ggml_cpu_has_avx2()) {
+        *ftype = LLAMA_FTYPE_MOSTLY_Q4_0;
+        return "q4_0";
+    }
+    return nullptr;
+}
+
+// "<dir>/<name>-<fingerprint>.<format>.gguf" next to the original, or in
+// `fallback_dir` when the original's directory is read-only. Keyed by the
+// original's fingerprint so a changed model never picks up a stale variant.
+static std::string variant_path(const std::string& model_path, const std::string& fallback_dir, const char* format) {
+    const std::string original = mapped_name(model_path);
+    const size_t slash = original.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : original.substr(0, slash);
+    std::string name = slash == std::string::npos ? original : original.substr(slash + 1);
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".gguf") == 0) {
+        name.resize(name.size() - 5);
+    }
+    if (access(dir.c_str(), W_OK) != 0) {
+        if (fallback_dir.empty()) {
+            return "";
+        }
+        dir = fallback_dir;
+    }
+    return dir + "/" + name + "-" + to_hex(model_fingerprint(model_path)) + "." + format + ".gguf";
+}
+
+// Path to load for `model_path`: its optimized variant once one has been built
+static std::string select_variant(const std::string& model_path, const std::string& state_dir) {
+    if (!g_use_variants.load()) {
+        return model_path;
+    }
+    std::lock_guard<std::mutex> lock(g_variant_mutex);
+    auto it = g_variants.find(model_path);
+    if (it == g_variants.end()) {
+        // Look for a variant built by an earlier process
+        std::string path;
+        llama_ftype ftype;
+        if (const char* format = optimized_format(&ftype)) {
+            path = variant_path(model_path, state_dir, format);
+            if (!path.empty() && access(path.c_str(), R_OK) != 0) {
+                path.clear();
+            }
+        }
+        it = g_variants.emplace(model_path, path).first;
+    }
+    return it->second.empty() ? model_path : it->second;
+}
+
+static void forget_variant(const std::string& model_path) {
+    std::lock_guard<std::mutex> lock(g_variant_mutex);
+    g_variants[model_path].clear();
+}
+
+// Process-wide registry of loaded models keyed by path.
+// Models stay resident until the byte budget is exceeded, then the
+// least-recently-used ones are evicted. The most recent model is always kept.
+// Loads run outside the registry lock; callers wanting a model that is still
+// loading wait for that load only.
+class ModelRegistry {
+private:
+    using LoadResult = std::shared_future<std::shared_ptr<LoadedModel>>;
+
+    struct PendingLoad {
+        LoadResult result;
+        uint64_t bytes; // counted against the budget while loading
+    };
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<LoadedModel>> m_models;
+    std::unordered_map<std::string, PendingLoad> m_loading;
+    uint64_t m_budget_bytes = DEFAULT_MODEL_BUDGET_BYTES;
+    std::string m_state_dir;
+    uint64_t m_tick = 0;
+
+    static uint64_t file_size(const std::string& path) {
+        struct stat st{};
+        return stat(path.c_str(), &st) == 0 ? (uint64_t) st.st_size : 0;
+    }
+
+    // Evict LRU models (except `keep`) until `incoming` more bytes fit the budget
+    void evict_locked(const std::string& keep, uint64_t incoming) {
+        while (true) {
+            uint64_t total = incoming;
+            for (auto& it : m_models) {
+                total += it.second->model.size_bytes();
+            }
+            for (auto& it : m_loading) {
+                total += it.second.bytes;
+            }
+            if (total <= m_budget_bytes) {
+                return;
+            }
+
+            auto victim = m_models.end();
+            for (auto it = m_models.begin(); it != m_models.end(); ++it) {
+                if (it->first == keep) continue;
+                if (victim == m_models.end() || it->second->last_used < victim->second->last_used) {
+                    victim = it;
+                }
+            }
+            if (victim == m_models.end()) {
+                return;
+            }
+
+            LOG_INFO("Evicting model %s (budget %llu bytes)", victim->first.c_str(),
+                     (unsigned long long) m_budget_bytes);
+            m_models.erase(victim);
+        }
+    }
+
+public:
+    static ModelRegistry& instance() {
+        static ModelRegistry registry;
+        return registry;
+    }
+
+    // Returns the resident model for `path`, loading it on first use.
+    // Returns nullptr if the model or its context cannot be created.
+    std::shared_ptr<LoadedModel> acquire(const std::string& path, const LoadProgress& on_progress = nullptr) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        std::string load_path;
+        while (true) {
+            load_path = select_variant(path, m_state_dir);
+            auto it = m_models.find(path);
+            if (it != m_models.end()) {
+                if (it->second->path == load_path) {
+                    it->second->last_used = ++m_tick;
+                    return it->second;
+                }
+                // An optimized variant was built since the model loaded
+                LOG_INFO("Replacing %s with %s", it->second->path.c_str(), load_path.c_str());
+                m_models.erase(it);
+            }
+
+            auto pending = m_loading.find(path);
+            if (pending == m_loading.end()) {
+                break;
+            }
+            // Wait for the load in progress; if it failed or was aborted
+            // (a superseded preload), look again and load it ourselves
+            LoadResult result = pending->second.result;
+            lock.unlock();
+            std::shared_ptr<LoadedModel> loaded = result.get();
+            lock.lock();
+            if (loaded) {
+                loaded->last_used = ++m_tick;
+                return loaded;
+            }
+        }
+
+        // Make room before loading so two large models are never resident over budget
+        const uint64_t bytes = file_size(load_path);
+        evict_locked(path, bytes);
+
+        std::promise<std::shared_ptr<LoadedModel>> promise;
+        m_loading[path] = PendingLoad{ promise.get_future().share(), bytes };
+        const std::string state_dir = m_state_dir;
+        lock.unlock();
+
+        std::shared_ptr<LoadedModel> entry;
+        try {
+            llama_ftype ftype;
+            const char* format = load_path != path ? optimized_format(&ftype) : nullptr;
+            entry = std::make_shared<LoadedModel>(load_path, state_dir, on_progress, format ? format : "");
+            if (!*entry && load_path != path) {
+                LOG_WARN("Failed to load %s, falling back to %s", load_path.c_str(), path.c_str());
+                forget_variant(path);
+                entry = std::make_shared<LoadedModel>(path, state_dir, on_progress);
+            }
+            if (!*entry) {
+                entry.reset();
+            }
+        } catch (const std::exception& e) {
+            LOG_ERROR("Exception while loading %s: %s", load_path.c_str(), e.what());
+            entry.reset();
+        }
+        if (entry) {
+            ResidencyManager::instance().on_load(entry);
+        }
+
+        lock.lock();
+        m_loading.erase(path);
+        if (entry) {
+            entry->last_used = ++m_tick;
+            m_models[path] = entry;
+        }
+        lock.unlock();
+        promise.set_value(entry);
+        return entry;
+    }
+
+    void set_budget(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget_bytes = bytes;
+        LOG_INFO("Model cache budget set to %llu bytes", (unsigned long long) bytes);
+        evict_locked("", 0);
+    }
+
+    std::string state_dir() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_state_dir;
+    }
+
+    void set_state_dir(const std::string& dir) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state_dir = dir;
+        for (auto& it : m_models) {
+            it.second->set_state_dir(dir);
+        }
+        LOG_INFO("Prompt state cache directory: %s", dir.c_str());
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_models.clear();
+    }
+
+    // Free the contexts of every resident model; returns how many were freed now
+    size_t release_contexts() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t n = 0;
+        for (auto& it : m_models) {
+            n += it.second->release_contexts();
+        }
+        return n;
+    }
+
+    // Unload every model. One still serving a request is freed when the
+    // request finishes; the next acquire loads it again. Returns the weight
+    // bytes freed now.
+    uint64_t unload_all() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t bytes = 0;
+        for (auto& it : m_models) {
+            if (it.second.use_count() == 1) {
+                bytes += it.second->model.size_bytes();
+            }
+            LOG_INFO("Unloading model %s", it.first.c_str());
+        }
+        m_models.clear();
+        return bytes;
+    }
+};
+
+// Initialize llama backend (thread-safe, called once)
+static void initialize_backend() {
+    if (!g_backend_initialized.exchange(true)) {
+        llama_backend_init(); // ✅ no arguments
+        LOG_INFO("Llama backend initialized");
+    }
+}
+
+
+// Tokenize input into `tokens`, reusing its capacity across calls. The
+// first pass uses whatever room the buffer has; when that is too small
+// llama_tokenize returns the negated token count and the second pass fits
+// exactly, so prompt length is only limited by the context.
+static bool tokenize_input(
+        const llama_vocab* vocab,
+        const std::string& prompt,
+        std::vector<llama_token>& tokens,
+        bool add_bos = true) {
+    tokens.clear();
+    if (!vocab) {
+        LOG_ERROR("Failed to get vocabulary");
+        return false;
+    }
+
+    tokens.resize(std::max(tokens.capacity(), prompt.size() / 4 + 16));
+
+    int n_tokens = llama_tokenize(
+            vocab,
+            prompt.c_str(),
+            prompt.size(),
+            tokens.data(),
+            tokens.size(),
+            add_bos,
+            false  // special
+    );
+
+    if (n_tokens < 0 && n_tokens != INT32_MIN) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.size(),
+                                  tokens.data(), tokens.size(), add_bos, false);
+    }
+
+    if (n_tokens < 0) {
+        LOG_ERROR("Tokenization failed for prompt (size: %zu)", prompt.size());
+        tokens.clear();
+        return false;
+    }
+
+    if (n_tokens == 0) {
+        LOG_ERROR("No tokens generated from prompt");
+        tokens.clear();
+        return false;
+    }
+
+    tokens.resize(n_tokens);
+    LOG_INFO("Tokenized %d tokens", n_tokens);
+
+    return true;
+}
+
+// Tokenize a prompt in two parts, up to and including the prefix boundary
+// and the rest, so the prefix tokens never depend on the item text that
+// follows. `n_stable` gets the prefix length, 0 when the boundary is absent.
+static bool tokenize_prompt(
+        const llama_vocab* vocab,
+        const std::string& prompt,
+        std::vector<llama_token>& tokens,
+        size_t* n_stable) {
+    *n_stable = 0;
+    std::string boundary;
+    {
+        std::lock_guard<std::mutex> lock(g_boundary_mutex);
+        boundary = g_prefix_boundary;
+    }
+    const size_t split = boundary.empty() ? std::string::npos : prompt.find(boundary);
+    if (split == std::string::npos || split + boundary.size() == prompt.size()) {
+        return tokenize_input(vocab, prompt, tokens);
+    }
+
+    const size_t end = split + boundary.size();
+    if (!tokenize_input(vocab, prompt.substr(0, end), tokens)) {
+        return false;
+    }
+    static thread_local std::vector<llama_token> suffix;
+    if (!tokenize_input(vocab, prompt.substr(end), suffix, false)) {
+        return false;
+    }
+    *n_stable = tokens.size();
+    tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+    return true;
+}
+
+// Handle a freshly sampled token: stop detection, detokenization and timing
+static void accept_token(SequenceState& seq, llama_token token, const llama_vocab* vocab) {
+    if (llama_vocab_is_eog(vocab, token)) {
+        LOG_INFO("End of generation token received (seq %d)", seq.seq_id);
+        seq.finish();
+        return;
+    }
+
+    // Time to first token, then the gap since the previous token
+    PhaseTimings& timings = seq.result.timings;
+    const auto t_token = Clock::now();
+    if (timings.ttft_us < 0) {
+        timings.ttft_us = elapsed_us(seq.t_admit, t_token);
+        LOG_INFO("First token received at %ld us (seq %d)", timings.ttft_us, seq.seq_id);
+    } else {
+        seq.itl_us.push_back(elapsed_us(seq.t_last_token, t_token));
+    }
+    seq.t_last_token = t_token;
+
+    // Token → text
+    char buffer[128];
+
+    int32_t n_chars = llama_token_to_piece(
+            vocab,                 // const llama_vocab *
+            token,                 // llama_token
+            buffer,                // char *
+            (int32_t)sizeof(buffer), // length
+            0,                     // lstrip (usually 0)
+            false                  // special tokens? false
+    );
+    timings.detok_us += elapsed_us(t_token, Clock::now());
+
+    if (n_chars > 0) {
+        seq.result.output.append(buffer, n_chars);
+        LOG_INFO("Generated token %d (seq %d): '%.*s'",
+                 seq.result.generated_tokens + 1, seq.seq_id, n_chars, buffer);
+
+        // Only the new piece can introduce a newline
+        if (memchr(buffer, '\n', n_chars) != nullptr) {
+            LOG_INFO("Newline detected, stopping generation (seq %d)", seq.seq_id);
+            seq.finish();
+            return;
+        }
+    } else if (n_chars < 0) {
+        LOG_ERROR("Failed to convert token to piece");
+        seq.finish();
+        return;
+    }
+
+    seq.result.generated_tokens++;
+
+    if (seq.result.generated_tokens >= MAX_GEN_TOKENS) {
+        seq.finish();
+        return;
+    }
+
+    seq.next_token = token;
+}
+
+// Greedy sampling, constrained by the grammar when one is attached. The
+// unconstrained argmax is checked first; the grammar only has to filter the
+// whole vocabulary when it rejects that token.
+static llama_token sample_token(SequenceState& seq, llama_context* ctx, const llama_vocab* vocab) {
+    if (!seq.grammar) {
+        return llama_sampler_sample(seq.sampler, ctx, seq.i_logits);
+    }
+
+    const float* logits = llama_get_logits_ith(ctx, seq.i_logits);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_token best = 0;
+    for (llama_token t = 1; t < n_vocab; t++) {
+        if (logits[t] > logits[best]) best = t;
+    }
+
+    llama_token_data single = { best, logits[best], 0.0f };
+    llama_token_data_array single_arr = { &single, 1, -1, false };
+    llama_sampler_apply(seq.grammar, &single_arr);
+
+    if (std::isinf(single.logit)) {
+        seq.candidates.resize(n_vocab);
+        for (llama_token t = 0; t < n_vocab; t++) {
+            seq.candidates[t] = { t, logits[t], 0.0f };
+        }
+
+        llama_token_data_array arr = { seq.candidates.data(), seq.candidates.size(), -1, false };
+        llama_sampler_apply(seq.grammar, &arr);
+
+        size_t i_best = 0;
+        for (size_t i = 1; i < arr.size; i++) {
+            if (arr.data[i].logit > arr.data[i_best].logit) i_best = i;
+        }
+        best = arr.data[i_best].id;
+    }
+
+    llama_sampler_accept(seq.grammar, best);
+    return best;
+}
+
+// Decode the batch, then sample every sequence whose logits it produced
+static bool decode_and_sample(
+        llama_context* ctx,
+        llama_batch& batch,
+        std::vector<SequenceState>& slots,
+        const llama_vocab* vocab) {
+
+    if (batch.n_tokens == 0) {
+        return true;
+    }
+
+    const auto t_decode = Clock::now();
+    int decode_result = llama_decode(ctx, batch);
+    batch.n_tokens = 0;
+    if (decode_result != 0) {
+        LOG_ERROR("Batch decoding failed with code: %d", decode_result);
+        return false;
+    }
+    const auto t_decoded = Clock::now();
+    const long step_us = elapsed_us(t_decode, t_decoded);
+
+    for (auto& seq : slots) {
+        if (seq.i_logits < 0) continue;
+
+        // The step that yields a prompt's first logits is part of its prefill
+        if (!seq.prefilled) {
+            seq.prefilled = true;
+            seq.t_prompt_end = t_decoded;
+        } else {
+            seq.result.timings.decode_us += step_us;
+        }
+
+        const auto t_sample = Clock::now();
+        llama_token token = sample_token(seq, ctx, vocab);
+        seq.result.timings.sample_us += elapsed_us(t_sample, Clock::now());
+        seq.i_logits = -1;
+        accept_token(seq, token, vocab);
+    }
+    return true;
+}
+
+// Compute the final metrics of a finished slot and hand its result back
+static InferenceResult complete_slot(PooledContext& pc, SequenceState& seq) {
+    InferenceResult r = seq.result;
+
+    PhaseTimings& t = r.timings;
+    if (seq.prefilled) {
+        t.prefill_us = elapsed_us(seq.t_admit, seq.t_prompt_end);
+        // Only tokens this prompt actually prefilled; a prefix hit is not throughput
+        r.itps = tokens_per_second((long) seq.tokens->size() - seq.n_reused, t.prefill_us);
+        r.otps = tokens_per_second(r.generated_tokens, elapsed_us(seq.t_prompt_end, seq.t_done)); // Generation time only
+    }
+    t.total_us = elapsed_us(seq.t_admit, seq.t_done);
+    set_itl_percentiles(seq.itl_us, t);
+    r.slot = seq.seq_id - FIRST_WORK_SEQ_ID;
+    r.label_mask = decode_label_mask(r.output);
+
+    seq.n_served++;
+    seq.n_generated += r.generated_tokens;
+    seq.busy_ms += t.total_us / 1000;
+
+    // Release the working sequence; the prefix stays cached for the next prompt
+    pc.ctx.clear_seq(seq.seq_id);
+    seq.release();
+    return r;
+}
+
+// Continuous-batching scheduler. Up to MAX_PARALLEL_SEQS slots decode in the
+// same llama_batch; as soon as a slot finishes, the next queued prompt is
+// admitted into it and its prefill is packed into the same llama_decode step
+// as the other slots' generation tokens, so short outputs never leave the
+// batch idle while longer ones are still generating.
+static std::vector<InferenceResult> run_scheduler(
+        PooledContext& pc,
+        const std::vector<std::string>& prompts,
+        const std::function<void(int, const std::vector<SequenceState>&)>& on_progress,
+        const std::atomic<bool>* cancel = nullptr) {
+
+    const int n_items = (int) prompts.size();
+    const int n_slots = std::min(n_items, MAX_PARALLEL_SEQS);
+    const llama_vocab* vocab = llama_model_get_vocab(pc.model.get());
+    const bool use_grammar = g_grammar_enabled.load();
+
+    std::vector<InferenceResult> results(n_items);
+    if (n_items == 0) {
+        return results;
+    }
+
+    DecodeArena& arena = pc.arena;
+
+    // Tokenize input into the arena's buffers; they only grow, never shrink
+    auto& tokens = arena.prompt_tokens;
+    auto& stable = arena.prompt_stable;
+    if ((int) tokens.size() < n_items) {
+        tokens.resize(n_items);
+    }
+    stable.resize(tokens.size());
+    const int n_ctx_train = llama_model_n_ctx_train(pc.model.get());
+    for (int i = 0; i < n_items; i++) {
+        if (!tokenize_prompt(vocab, prompts[i], tokens[i], &stable[i])) {
+            results[i].error = "Tokenization failed";
+        } else if ((int) tokens[i].size() + MAX_GEN_TOKENS > n_ctx_train) {
+            LOG_ERROR("Prompt too long: %zu tokens (model context %d)", tokens[i].size(), n_ctx_train);
+            results[i].error = "Prompt too long";
+            tokens[i].clear();
+        }
+    }
+
+    // Size the context for the worst case that can occur in this run. Forked
+    // prefix cells are shared, so each slot needs only what it decodes itself:
+    // the part of its prompt past the prefix (all of it when the prompt has no
+    // boundary) plus the generation budget. A prompt whose prefix differs from
+    // the cached one rebuilds it while slots may still hold the old cells, so
+    // then both prefixes count.
+    size_t max_stable = 0;
+    size_t max_uncached = 0;
+    bool prefix_warm = pc.prefix.size() > 0;
+    for (int i = 0; i < n_items; i++) {
+        const auto& t = tokens[i];
+        if (t.empty()) continue;
+        const bool cacheable = stable[i] >= (size_t) MIN_PREFIX_TOKENS && stable[i] < t.size();
+        max_stable = std::max(max_stable, cacheable ? stable[i] : 0);
+        max_uncached = std::max(max_uncached, t.size() - (cacheable ? stable[i] : 0));
+        prefix_warm = prefix_warm && cacheable && pc.prefix.matches(t, stable[i]);
+    }
+
+    const size_t n_prefix = prefix_warm ? pc.prefix.size() : pc.prefix.size() + max_stable;
+    int n_required = (int) n_prefix + n_slots * (int) (max_uncached + MAX_GEN_TOKENS);
+
+    if (!pc.reserve(n_required)) {
+        for (auto& r : results) {
+            if (r.error.empty()) r.error = "Failed to create context";
+        }
+        return results;
+    }
+
+    llama_context* ctx = pc.ctx.get();
+    const int n_batch = pc.ctx.batch_capacity();
+
+    // Slots live in the arena; with fewer prompts than slots the extra ones
+    // are never admitted into, so at most n_slots are busy at once
+    std::vector<SequenceState>& slots = arena.slots;
+    for (auto& seq : slots) {
+        seq.reset_stats();
+        pc.ctx.clear_seq(seq.seq_id);
+    }
+
+    // The context's batch is reused for every step; it is empty whenever
+    // slots are admitted, so prefix attach may decode through it too
+    llama_batch& batch = pc.ctx.batch();
+
+    llama_perf_context_reset(ctx);
+    auto t_start = Clock::now();
+    int next_item = 0;
+    int n_generated_total = 0;
+    int n_steps = 0;
+    bool ok = true;
+    bool cancelled = false;
+
+    while (ok) {
+        // Admit queued prompts into free slots
+        for (auto& seq : slots) {
+            if (seq.busy()) continue;
+
+            while (next_item < n_items && tokens[next_item].empty()) next_item++;
+            if (next_item >= n_items) break;
+
+            seq.item = next_item++;
+            seq.tokens = &tokens[seq.item];
+            seq.result.reset();
+            seq.i_logits = -1;
+            seq.prefilled = false;
+            seq.done = false;
+            seq.itl_us.clear();
+            seq.t_admit = Clock::now();
+
+            // Fork the cached system-prompt prefix into the slot's sequence
+            seq.n_past = pc.prefix.attach(pc.ctx, *seq.tokens, stable[seq.item], seq.seq_id);
+            seq.n_reused = seq.n_past;
+            if (!seq.sampler) {
+                seq.sampler = llama_sampler_init_greedy();
+            }
+            if (use_grammar) {
+                seq.grammar = pc.clone_grammar();
+            }
+            if (!seq.sampler || (use_grammar && !seq.grammar)) {
+                seq.result.error = "Failed to create sampler";
+                seq.finish();
+            }
+        }
+
+        // Generation tokens go first so running slots are never starved by a prefill
+        for (auto& seq : slots) {
+            if (!seq.generating()) continue;
+            seq.i_logits = batch.n_tokens;
+            batch_add(batch, seq.next_token, seq.n_past++, seq.seq_id, true);
+        }
+
+        // Fill the remaining room with prompt chunks of newly admitted slots
+        for (auto& seq : slots) {
+            if (!seq.busy() || seq.prefilled || seq.done) continue;
+
+            const int n_prompt = (int) seq.tokens->size();
+            while (seq.n_past < n_prompt && batch.n_tokens < n_batch) {
+                const bool last = (seq.n_past == n_prompt - 1);
+                if (last) seq.i_logits = batch.n_tokens;
+                batch_add(batch, (*seq.tokens)[seq.n_past], seq.n_past, seq.seq_id, last); // Logits only for last token
+                seq.n_past++;
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            bool any_busy = false;
+            for (auto& seq : slots) any_busy = any_busy || seq.busy();
+            if (!any_busy) break;
+        }
+
+        const bool decoded = decode_and_sample(ctx, batch, slots, vocab);
+        cancelled = cancel && cancel->load();
+        if (!decoded || cancelled) {
+            ok = false;
+            for (auto& seq : slots) {
+                if (!seq.busy() || seq.done) continue;
+                if (cancelled) {
+                    seq.result.error = "Cancelled";
+                } else if (!seq.prefilled) {
+                    seq.result.error = "Prompt decoding failed";
+                }
+                seq.finish();
+            }
+        }
+        n_steps++;
+
+        // Progress callback, before retirement so it also sees slots that just finished
+        if (on_progress) {
+            int n_generated = n_generated_total;
+            for (auto& seq : slots) {
+                if (seq.busy()) n_generated += seq.result.generated_tokens;
+            }
+            on_progress((n_generated * 100) / (n_items * MAX_GEN_TOKENS), slots);
+        }
+
+        // Retire finished slots so they can be refilled on the next step
+        for (auto& seq : slots) {
+            if (!seq.busy() || !seq.done) continue;
+            const int item = seq.item;
+            results[item] = complete_slot(pc, seq);
+            n_generated_total += results[item].generated_tokens;
+        }
+    }
+
+    // Items that were never admitted because decoding failed or the run was cancelled
+    for (int i = next_item; i < n_items; i++) {
+        if (results[i].error.empty()) results[i].error = cancelled ? "Cancelled" : "Prompt decoding failed";
+    }
+
+    batch.n_tokens = 0;
+    set_perf_timings(ctx, results);
+
+    const MemoryStats memory = pc.memory_stats();
+    for (auto& r : results) {
+        r.memory = memory;
+        r.weights_path = pc.model.path();
+        r.weights_format = pc.weights_format;
+    }
+    LOG_INFO("Memory: model %llu MB (%llu MB resident), RSS %llu MB (peak %llu MB)",
+             (unsigned long long) (memory.model_bytes >> 20), (unsigned long long) (memory.model_resident_bytes >> 20),
+             (unsigned long long) (memory.rss_bytes >> 20), (unsigned long long) (memory.peak_rss_bytes >> 20));
+
+    long total_ms = elapsed_ms(t_start, Clock::now());
+    LOG_INFO("Scheduler complete: %d prompts, %d tokens generated in %ld ms over %d steps (%ld tok/s)",
+             n_items, n_generated_total, total_ms, n_steps,
+             (total_ms > 0) ? (n_generated_total * 1000L) / total_ms : 0);
+
+    for (int s = 0; s < n_slots; s++) {
+        const SequenceState& seq = slots[s];
+        LOG_INFO("Slot %d: %d prompts, %d tokens, busy %ld ms (%ld%%)",
+                 s, seq.n_served, seq.n_generated, seq.busy_ms,
+                 (total_ms > 0) ? (seq.busy_ms * 100) / total_ms : 0);
+    }
+
+    return results;
+}
+
+// Single-pass multi-label scoring. The prompt is prefilled once, forked into
+// one sequence per allergen, and every sequence gets a short yes/no probe.
+// All probes are decoded in one llama_decode and each label's probability is
+// the softmax of its best "yes" against its best "no" logit, so no
+// autoregressive generation is needed.
+static InferenceResult run_scoring(PooledContext& pc, const std::string& prompt) {
+    const llama_vocab* vocab = llama_model_get_vocab(pc.model.get());
+    InferenceResult result;
+
+    DecodeArena& arena = pc.arena;
+
+    // Tokenize input
+    if (arena.prompt_tokens.empty()) {
+        arena.prompt_tokens.resize(1);
+    }
+    arena.prompt_stable.resize(arena.prompt_tokens.size());
+    std::vector<llama_token>& tokens = arena.prompt_tokens[0];
+    size_t& n_stable = arena.prompt_stable[0];
+    if (!tokenize_prompt(vocab, prompt, tokens, &n_stable)) {
+        result.error = "Tokenization failed";
+        return result;
+    }
+
+    // Probes and answer tokens depend only on the vocabulary; build them once
+    if (!arena.probes_ready) {
+        for (int i = 0; i < N_ALLERGENS; i++) {
+            if (!tokenize_input(vocab, std::string(" Contains ") + ALLERGEN_LABELS[i] + "? Answer:",
+                                arena.probe_tokens[i], false)) {
+                result.error = "Tokenization failed";
+                return result;
+            }
+        }
+
+        // First token of each answer spelling that encodes to a single token
+        std::vector<llama_token> t;
+        arena.yes_tokens.clear();
+        arena.no_tokens.clear();
+        for (const char* answer : { " yes", " Yes", "yes", "Yes" }) {
+            if (tokenize_input(vocab, answer, t, false) && t.size() == 1) arena.yes_tokens.push_back(t[0]);
+        }
+        for (const char* answer : { " no", " No", "no", "No" }) {
+            if (tokenize_input(vocab, answer, t, false) && t.size() == 1) arena.no_tokens.push_back(t[0]);
+        }
+        arena.probes_ready = true;
+    }
+    if (arena.yes_tokens.empty() || arena.no_tokens.empty()) {
+        result.error = "No single-token yes/no answers in vocabulary";
+        return result;
+    }
+
+    size_t n_probe_tokens = 0;
+    size_t max_probe = 0;
+    for (const auto& probe : arena.probe_tokens) {
+        n_probe_tokens += probe.size();
+        max_probe = std::max(max_probe, probe.size());
+    }
+    if ((int) (tokens.size() + max_probe) > llama_model_n_ctx_train(pc.model.get())) {
+        LOG_ERROR("Prompt too long: %zu tokens", tokens.size());
+        result.error = "Prompt too long";
+        return result;
+    }
+
+    if (!pc.reserve((int) (pc.prefix.size() + tokens.size() + n_probe_tokens))) {
+        result.error = "Failed to create context";
+        return result;
+    }
+    if ((int) n_probe_tokens > pc.ctx.batch_capacity()) {
+        result.error = "Probes exceed batch size";
+        return result;
+    }
+
+    llama_context* ctx = pc.ctx.get();
+    llama_memory_t mem = llama_get_memory(ctx);
+    const llama_seq_id prompt_seq = FIRST_WORK_SEQ_ID;
+    const int n_prompt = (int) tokens.size();
+
+    // Start timing for overall inference
+    llama_perf_context_reset(ctx);
+    auto t_inference_start = Clock::now();
+
+    // --- PROMPT PROCESSING ---
+    pc.ctx.clear_seq(prompt_seq);
+    int n_reused = pc.prefix.attach(pc.ctx, tokens, n_stable, prompt_seq);
+
+    int decode_result = decode_tokens(pc.ctx, tokens.data() + n_reused, n_prompt - n_reused,
+                                      n_reused, prompt_seq, false);
+    if (decode_result != 0) {
+        LOG_ERROR("Prompt decoding failed with code: %d", decode_result);
+        pc.ctx.clear_seq(prompt_seq);
+        result.error = "Prompt decoding failed";
+        return result;
+    }
+
+    auto t_prompt_end = Clock::now();
+
+    // --- PROBES ---
+    // All probes go into the context's batch in a single decode
+    llama_batch& batch = pc.ctx.batch();
+
+    int i_logits[N_ALLERGENS];
+    for (int i = 0; i < N_ALLERGENS; i++) {
+        const std::vector<llama_token>& probe = arena.probe_tokens[i];
+        const llama_seq_id probe_seq = prompt_seq + 1 + i;
+        pc.ctx.clear_seq(probe_seq);
+        llama_memory_seq_cp(mem, prompt_seq, probe_seq, -1, -1);
+
+        for (size_t j = 0; j < probe.size(); j++) {
+            const bool last = (j == probe.size() - 1);
+            if (last) i_logits[i] = batch.n_tokens;
+            batch_add(batch, probe[j], n_prompt + (int) j, probe_seq, last);
+        }
+    }
+
+    decode_result = llama_decode(ctx, batch);
+    batch.n_tokens = 0;
+    auto t_probes_end = Clock::now();
+
+    if (decode_result != 0) {
+        LOG_ERROR("Probe decoding failed with code: %d", decode_result);
+        result.error = "Probe decoding failed";
+    } else {
+        result.label_probs.resize(N_ALLERGENS);
+
+        for (int i = 0; i < N_ALLERGENS; i++) {
+            const float* logits = llama_get_logits_ith(ctx, i_logits[i]);
+
+            float yes = -INFINITY;
+            float no = -INFINITY;
+            for (llama_token t : arena.yes_tokens) yes = std::max(yes, logits[t]);
+            for (llama_token t : arena.no_tokens) no = std::max(no, logits[t]);
+
+            const float p = 1.0f / (1.0f + std::exp(no - yes));
+            result.label_probs[i] = p;
+
+            if (p >= 0.5f) {
+                result.label_mask |= 1 << i;
+                if (!result.output.empty()) result.output += ", ";
+                result.output += ALLERGEN_LABELS[i];
+            }
+        }
+        if (result.output.empty()) {
+            result.output = "EMPTY";
+        }
+        result.timings.sample_us = elapsed_us(t_probes_end, Clock::now());
+    }
+
+    // Release the prompt and probe sequences; the prefix stays cached
+    for (int i = 0; i <= N_ALLERGENS; i++) {
+        pc.ctx.clear_seq(prompt_seq + i);
+    }
+
+    auto t_inference_end = Clock::now();
+    PhaseTimings& t = result.timings;
+
+    t.prefill_us = elapsed_us(t_inference_start, t_prompt_end);
+    t.decode_us = elapsed_us(t_prompt_end, t_probes_end);
+    t.ttft_us = elapsed_us(t_inference_start, t_inference_end);
+    t.total_us = t.ttft_us;
+    result.itps = tokens_per_second(n_prompt - n_reused, t.prefill_us);
+
+    const llama_perf_context_data perf = llama_perf_context(ctx);
+    t.perf_prompt_us = (long) (perf.t_p_eval_ms * 1000.0);
+    t.perf_eval_us = (long) (perf.t_eval_ms * 1000.0);
+    result.memory = pc.memory_stats();
+    result.weights_path = pc.model.path();
+    result.weights_format = pc.weights_format;
+
+    LOG_INFO("Scoring complete in %ld us (prefill %ld us, probes %ld us, %d reused tokens), mask=0x%03x",
+             t.total_us, t.prefill_us, t.decode_us, n_reused, (unsigned) result.label_mask);
+    return result;
+}
+
+// Auto-tuner probe sizes: a prompt of typical length (system prompt, guide
+// and ingredients) and a short single-sequence generation run
+static const int TUNE_PROMPT_TOKENS = 384;
+static const int TUNE_GEN_TOKENS = 16;
+static const int TUNE_UBATCH_SIZES[] = { 128, 256, 512 };
+
+// Prefill throughput (tokens/s) of the current context config
+static long tune_prefill(PooledContext& pc, const std::vector<llama_token>& tokens) {
+    pc.ctx.clear();
+    auto t_start = Clock::now();
+    if (decode_tokens(pc.ctx, tokens.data(), (int) tokens.size(), 0, FIRST_WORK_SEQ_ID, true) != 0) {
+        return 0;
+    }
+    llama_synchronize(pc.ctx.get());
+    long us = elapsed_us(t_start, Clock::now());
+    return us > 0 ? ((long) tokens.size() * 1000000L) / us : 0;
+}
+
+// Single-token decode throughput (tokens/s) after a short prompt
+static long tune_decode(PooledContext& pc, const std::vector<llama_token>& tokens) {
+    const int n_prompt = 64;
+    pc.ctx.clear();
+    if (decode_tokens(pc.ctx, tokens.data(), n_prompt, 0, FIRST_WORK_SEQ_ID, true) != 0) {
+        return 0;
+    }
+    auto t_start = Clock::now();
+    for (int i = 0; i < TUNE_GEN_TOKENS; i++) {
+        if (decode_tokens(pc.ctx, &tokens[n_prompt + i], 1, n_prompt + i, FIRST_WORK_SEQ_ID, true) != 0) {
+            return 0;
+        }
+    }
+    llama_synchronize(pc.ctx.get());
+    long us = elapsed_us(t_start, Clock::now());
+    return us > 0 ? (TUNE_GEN_TOKENS * 1000000L) / us : 0;
+}
+
+// Sweep flash attention, ubatch size and prefill/decode thread counts for
+// this model on this CPU, keep the config with the lowest estimated request
+// latency and persist it next to the prompt cache. Prefill settings are
+// picked by ITPS first, then decode threads by OTPS, once per flash-attention
+// mode, which keeps the sweep to a few dozen short probes.
+static std::string run_tuning(ContextLease& lease, bool force) {
+    LoadedModel& loaded = lease.model();
+    PooledContext& pc = *lease;
+
+    bool tuned = false;
+    const ContextConfig original = loaded.config(&tuned);
+    if (tuned && !force) {
+        LOG_INFO("Model already tuned: %s", original.to_string().c_str());
+        return "DECODE_THREADS=" + std::to_string(original.n_decode_threads) +
+               ";PREFILL_THREADS=" + std::to_string(original.n_prefill_threads) +
+               ";UBATCH=" + std::to_string(original.n_ubatch) +
+               ";FLASH_ATTN=" + std::to_string((int) original.flash_attn) + "|cached";
+    }
+
+    // A request waiting for this lane aborts the sweep; the model keeps its
+    // current config and the next tune() starts over
+    const std::atomic<bool>& preempted = *lease.preempt_flag();
+    pc.ctx.set_abort_flag(&preempted);
+
+    // Measured on the lane this request holds; with several lanes each
+    // context only ever gets its own share of the cores
+    ThreadPools& pools = ThreadPools::instance();
+    const int lane = lease.lane();
+    const int n_decode_max = pools.n_decode(lane);
+    const int n_prefill_max = pools.n_prefill(lane);
+
+    // Thread-count grids; {0} (pool defaults) when threadpools are unavailable
+    std::vector<int> decode_grid;
+    for (int n : { 2, 4, n_decode_max }) {
+        if (n >= 1 && n <= n_decode_max && std::find(decode_grid.begin(), decode_grid.end(), n) == decode_grid.end()) {
+            decode_grid.push_back(n);
+        }
+    }
+    std::vector<int> prefill_grid;
+    for (int n : { n_decode_max, n_prefill_max }) {
+        if (n >= 1 && std::find(prefill_grid.begin(), prefill_grid.end(), n) == prefill_grid.end()) {
+            prefill_grid.push_back(n);
+        }
+    }
+    if (decode_grid.empty()) decode_grid.push_back(0);
+    if (prefill_grid.empty()) prefill_grid.push_back(0);
+
+    // Probe content does not affect timing; any valid token ids will do
+    const llama_vocab* vocab = llama_model_get_vocab(pc.model.get());
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<llama_token> tokens(TUNE_PROMPT_TOKENS + TUNE_GEN_TOKENS);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i] = (llama_token) ((i * 7919 + 13) % n_vocab);
+    }
+
+    ContextConfig best;
+    long best_itps = 0;
+    long best_otps = 0;
+    double best_ms = INFINITY;
+
+    for (llama_flash_attn_type flash : { LLAMA_FLASH_ATTN_TYPE_DISABLED, LLAMA_FLASH_ATTN_TYPE_ENABLED }) {
+        // A quantized KV cache always runs with flash attention
+        if (original.kv_cache != KV_CACHE_F16 && flash == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
+            continue;
+        }
+        ContextConfig cand;
+        cand.flash_attn = flash;
+        cand.kv_cache = original.kv_cache;
+        long cand_itps = 0;
+
+        for (int n_ubatch : TUNE_UBATCH_SIZES) {
+            ContextConfig cfg = cand;
+            cfg.n_ubatch = n_ubatch;
+            if (preempted.load()) {
+                break;
+            }
+            if (!pc.apply_config(cfg) || !pc.reserve((int) tokens.size())) {
+                continue;
+            }
+            tune_prefill(pc, tokens); // warm-up
+
+            for (int n_threads : prefill_grid) {
+                cfg.n_prefill_threads = n_threads;
+                pools.attach(pc.ctx.get(), cfg, lane);
+                long itps = tune_prefill(pc, tokens);
+                LOG_INFO("Tune prefill: %s -> %ld tok/s", cfg.to_string().c_str(), itps);
+                if (itps > cand_itps) {
+                    cand_itps = itps;
+                    cand.n_ubatch = n_ubatch;
+                    cand.n_prefill_threads = n_threads;
+                }
+            }
+        }
+        if (preempted.load()) {
+            break;
+        }
+        if (cand_itps == 0 || !pc.apply_config(cand) || !pc.reserve((int) tokens.size())) {
+            continue;
+        }
+
+        long cand_otps = 0;
+        for (int n_threads : decode_grid) {
+            ContextConfig cfg = cand;
+            cfg.n_decode_threads = n_threads;
+            pools.attach(pc.ctx.get(), cfg, lane);
+            long otps = tune_decode(pc, tokens);
+            LOG_INFO("Tune decode: %s -> %ld tok/s", cfg.to_string().c_str(), otps);
+            if (otps > cand_otps) {
+                cand_otps = otps;
+                cand.n_decode_threads = n_threads;
+            }
+        }
+        if (cand_otps == 0) {
+            continue;
+        }
+
+        const double ms = TUNE_PROMPT_TOKENS * 1000.0 / cand_itps + MAX_GEN_TOKENS * 1000.0 / cand_otps;
+        if (ms < best_ms) {
+            best_ms = ms;
+            best = cand;
+            best_itps = cand_itps;
+            best_otps = cand_otps;
+        }
+    }
+
+    // The probes overwrote the KV cache, including the cached prefix
+    pc.ctx.clear();
+    pc.prefix.reset();
+
+    if (preempted.load() || std::isinf(best_ms)) {
+        pc.apply_config(original);
+        pools.attach(pc.ctx.get(), original, lane);
+        if (preempted.load()) {
+            LOG_INFO("Tuning preempted by a request");
+            return "ERROR|Preempted";
+        }
+        return "ERROR|Tuning failed";
+    }
+
+    // Other pooled contexts switch to the new config at their next checkout
+    pc.apply_config(best);
+    pools.attach(pc.ctx.get(), best, lane);
+    loaded.set_tuned_config(best);
+
+    const bool saved = save_context_config(loaded.config_path(), best);
+    LOG_INFO("Tuned config: %s (ITPS=%ld, OTPS=%ld, est. %.0f ms/request)%s",
+             best.to_string().c_str(), best_itps, best_otps, best_ms, saved ? "" : ", not persisted");
+
+    return "DECODE_THREADS=" + std::to_string(best.n_decode_threads) +
+           ";PREFILL_THREADS=" + std::to_string(best.n_prefill_threads) +
+           ";UBATCH=" + std::to_string(best.n_ubatch) +
+           ";FLASH_ATTN=" + std::to_string((int) best.flash_attn) +
+           ";ITPS=" + std::to_string(best_itps) +
+           ";OTPS=" + std::to_string(best_otps) + (saved ? "|saved" : "|not saved");
+}
+
+// Stage micro-benchmarks. Each stage runs the engine's own code path in
+// isolation on one pooled context: BENCH_WARMUP untimed runs, then
+// `iterations` timed ones. Stages too cheap to time one call at a time are
+// timed over several calls per iteration and reported per call.
+static const int BENCH_WARMUP = 3;
+static const int BENCH_LABEL_CALLS = 100;
+
+// Ingredient text repeated until the prompt reaches the requested length
+static const char* BENCH_PROMPT_TEXT =
+        "wheat flour, sugar, palm oil, whole milk powder, hazelnuts, soy lecithin, "
+        "egg yolk, salt, sesame seeds, cocoa butter, natural flavourings, ";
+
+// Typical model output for the label post-processing stage
+static const char* BENCH_LABEL_OUTPUT = "milk, egg, tree nut, wheat, soy, sesame";
+
+using BenchSample = std::chrono::duration<double, std::micro>;
+
+static StageStats summarize_stage(const char* name, int ops_per_iteration, std::vector<double>& samples_us) {
+    StageStats st;
+    st.stage = name;
+    st.iterations = (int) samples_us.size();
+    st.ops_per_iteration = ops_per_iteration;
+    if (samples_us.empty()) {
+        return st;
+    }
+
+    for (double& us : samples_us) {
+        us /= ops_per_iteration;
+    }
+    std::sort(samples_us.begin(), samples_us.end());
+
+    double sum = 0;
+    for (double us : samples_us) sum += us;
+    st.mean_us = sum / samples_us.size();
+    double var = 0;
+    for (double us : samples_us) var += (us - st.mean_us) * (us - st.mean_us);
+    st.stddev_us = samples_us.size() > 1 ? std::sqrt(var / (samples_us.size() - 1)) : 0.0;
+
+    auto at = [&samples_us](double p) { return samples_us[(size_t) (p * (samples_us.size() - 1) + 0.5)]; };
+    st.min_us = samples_us.front();
+    st.p50_us = at(0.50);
+    st.p90_us = at(0.90);
+    st.p99_us = at(0.99);
+    st.max_us = samples_us.back();
+    return st;
+}
+
+// Time `fn` BENCH_WARMUP + iterations times, keeping the timed samples.
+// Stops at the first failing run.
+static bool bench_stage(int iterations, std::vector<double>& samples_us, const std::function<bool()>& fn) {
+    samples_us.clear();
+    for (int i = 0; i < BENCH_WARMUP + iterations; i++) {
+        const auto t_start = Clock::now();
+        if (!fn()) {
+            return false;
+        }
+        const BenchSample us = Clock::now() - t_start;
+        if (i >= BENCH_WARMUP) {
+            samples_us.push_back(us.count());
+        }
+    }
+    return true;
+}
+
+static std::vector<StageStats> run_stage_benchmark(PooledContext& pc, int n_prompt_tokens, int iterations) {
+    std::vector<StageStats> stats;
+    const llama_vocab* vocab = llama_model_get_vocab(pc.model.get());
+    llama_context* ctx = pc.ctx.get();
+    llama_memory_t mem = llama_get_memory(ctx);
+    const llama_seq_id seq_id = FIRST_WORK_SEQ_ID;
+
+    // Prompt text of at least n_prompt_tokens; prefill uses exactly that many
+    std::string prompt;
+    std::vector<llama_token> tokens;
+    while ((int) tokens.size() < n_prompt_tokens) {
+        prompt += BENCH_PROMPT_TEXT;
+        if (!tokenize_input(vocab, prompt, tokens)) {
+            return stats;
+        }
+    }
+    std::vector<llama_token> prompt_tokens(tokens.begin(), tokens.begin() + n_prompt_tokens);
+
+    if (!pc.reserve(n_prompt_tokens + 1)) {
+        return stats;
+    }
+    ctx = pc.ctx.get();
+    mem = llama_get_memory(ctx);
+    std::vector<double> samples;
+
+    if (bench_stage(iterations, samples, [&] { return tokenize_input(vocab, prompt, tokens); })) {
+        stats.push_back(summarize_stage("tokenize", 1, samples));
+    }
+
+    const bool prefilled = bench_stage(iterations, samples, [&] {
+        llama_memory_clear(mem, true);
+        const bool ok = decode_tokens(pc.ctx, prompt_tokens.data(), n_prompt_tokens, 0, seq_id, true) == 0;
+        llama_synchronize(ctx);
+        return ok;
+    });
+    if (prefilled) {
+        stats.push_back(summarize_stage("prefill", 1, samples));
+    }
+
+    // One generated token at a constant depth: the step's KV cell is
+    // dropped again before the next run. Needs the prefill above.
+    const llama_token next = prompt_tokens.back();
+    const bool decoded = prefilled && bench_stage(iterations, samples, [&] {
+        llama_memory_seq_rm(mem, seq_id, n_prompt_tokens, -1);
+        const bool ok = decode_tokens(pc.ctx, &next, 1, n_prompt_tokens, seq_id, true) == 0;
+        llama_synchronize(ctx);
+        return ok;
+    });
+    if (decoded) {
+        stats.push_back(summarize_stage("decode_step", 1, samples));
+    }
+
+    // Greedy sampling over the logits of the last decode step
+    SequenceState seq;
+    seq.sampler = llama_sampler_init_greedy();
+    if (decoded && bench_stage(iterations, samples, [&] {
+        seq.i_logits = -1;
+        return sample_token(seq, ctx, vocab) != LLAMA_TOKEN_NULL;
+    })) {
+        stats.push_back(summarize_stage("sample_greedy", 1, samples));
+    }
+
+    char piece[128];
+    if (bench_stage(iterations, samples, [&] {
+        for (llama_token t : prompt_tokens) {
+            if (llama_token_to_piece(vocab, t, piece, (int32_t) sizeof(piece), 0, false) < 0) {
+                return false;
+            }
+        }
+        return true;
+    })) {
+        stats.push_back(summarize_stage("token_to_piece", n_prompt_tokens, samples));
+    }
+
+    const std::string output = BENCH_LABEL_OUTPUT;
+    volatile int mask_sink = 0;
+    if (bench_stage(iterations, samples, [&] {
+        for (int i = 0; i < BENCH_LABEL_CALLS; i++) {
+            mask_sink = mask_sink + decode_label_mask(output);
+        }
+        return true;
+    })) {
+        stats.push_back(summarize_stage("label_mask", BENCH_LABEL_CALLS, samples));
+    }
+
+    // The runs overwrote the KV cache, including the cached prefix
+    pc.ctx.clear();
+    pc.prefix.reset();
+    return stats;
+}
+
+// One throwaway decode in llama's warmup mode, which runs every weight
+// tensor once: the mapped weights are paged in and the kernels' first-run
+// costs are paid before the first request
+static bool warmup_context(PooledContext& pc) {
+    llama_context* ctx = pc.ctx.get();
+    const llama_vocab* vocab = llama_model_get_vocab(pc.model.get());
+
+    std::vector<llama_token> tokens;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) tokens.push_back(llama_vocab_bos(vocab));
+    if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) tokens.push_back(llama_vocab_eos(vocab));
+    if (tokens.empty()) tokens.push_back(0);
+
+    const auto t_start = Clock::now();
+    llama_set_warmup(ctx, true);
+    const bool ok = decode_tokens(pc.ctx, tokens.data(), (int) tokens.size(), 0, FIRST_WORK_SEQ_ID, true) == 0;
+    llama_synchronize(ctx);
+    llama_set_warmup(ctx, false);
+    pc.ctx.clear_seq(FIRST_WORK_SEQ_ID);
+
+    LOG_INFO("Warmup decode %s in %ld ms", ok ? "done" : "failed", elapsed_ms(t_start, Clock::now()));
+    return ok;
+}
+
+// Loads models ahead of the first request, on its own thread. Only the
+// latest request matters: it replaces a pending one, and a load still in
+// progress for another model is aborted through the progress callback.
+class Preloader {
+private:
+    struct Request {
+        std::string path;
+        ProgressCallback on_progress;
+        PreloadCallback on_done;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::unique_ptr<Request> m_pending;
+    std::string m_loading; // path of the request being served
+    std::string m_wanted;  // path of the latest request, empty after cancel()
+    std::thread m_thread;
+    bool m_stop = false;
+
+    Preloader() = default;
+
+    static bool preload(const Request& req, const std::function<bool()>& wanted) {
+        std::call_once(g_backend_init_flag, initialize_backend);
+        const auto t_start = Clock::now();
+
+        int last = -1;
+        std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(req.path, [&](float progress) {
+            const int percent = (int) (progress * 100.0f);
+            if (req.on_progress && percent != last) {
+                last = percent;
+                req.on_progress(percent);
+            }
+            return wanted();
+        });
+        if (!loaded) {
+            return false;
+        }
+        if (req.on_progress && last < 100) {
+            req.on_progress(100);
+        }
+
+        if (!loaded->warmed.exchange(true)) {
+            ContextLease lease(loaded);
+            if (!lease || !warmup_context(*lease)) {
+                loaded->warmed.store(false);
+                return false;
+            }
+        }
+        LOG_INFO("Preloaded %s in %ld ms", req.path.c_str(), elapsed_ms(t_start, Clock::now()));
+        return true;
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] { return m_stop || m_pending; });
+            if (m_stop) {
+                break;
+            }
+            std::unique_ptr<Request> req = std::move(m_pending);
+            m_loading = req->path;
+            lock.unlock();
+
+            bool ok = false;
+            try {
+                ok = preload(*req, [this, &req] {
+                    std::lock_guard<std::mutex> wanted_lock(m_mutex);
+                    return m_wanted == req->path;
+                });
+            } catch (const std::exception& e) {
+                LOG_ERROR("Exception during preload: %s", e.what());
+            }
+            if (req->on_done) {
+                req->on_done(ok);
+            }
+
+            lock.lock();
+            m_loading.clear();
+        }
+    }
+
+public:
+    static Preloader& instance() {
+        static Preloader preloader;
+        return preloader;
+    }
+
+    ~Preloader() {
+        cancel();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void request(const std::string& path, ProgressCallback on_progress, PreloadCallback on_done) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wanted = path;
+        if (path == m_loading) {
+            m_pending.reset(); // already on its way
+            return;
+        }
+        m_pending.reset(new Request{ path, std::move(on_progress), std::move(on_done) });
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&Preloader::loop, this);
+        }
+        m_cv.notify_one();
+    }
+
+    // Drop the pending request and abort a load in progress
+    void cancel() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.reset();
+        m_wanted.clear();
+    }
+};
+
+// File type recorded in a model's metadata, read without loading its weights;
+// -1 when unknown
+static int model_file_type(const std::string& path) {
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    llama_model* model = llama_model_load_from_file(path.c_str(), params);
+    if (!model) {
+        return -1;
+    }
+    char buf[16];
+    const int ftype = llama_model_meta_val_str(model, "general.file_type", buf, sizeof(buf)) > 0 ? atoi(buf) : -1;
+    llama_model_free(model);
+    return ftype;
+}
+
+// Requantize `model_path` into the optimized format for this CPU once, with
+// every core, and return the variant's path; empty when there is none
+static std::string build_variant(const std::string& model_path) {
+    llama_ftype ftype;
+    const char* format = optimized_format(&ftype);
+    if (!format) {
+        LOG_INFO("No faster weight format than the original on this CPU");
+        return "";
+    }
+
+    std::lock_guard<std::mutex> build_lock(g_variant_build_mutex);
+    const std::string out = variant_path(model_path, ModelRegistry::instance().state_dir(), format);
+    if (out.empty()) {
+        LOG_WARN("No writable directory for the %s variant of %s", format, model_path.c_str());
+        return "";
+    }
+
+    if (access(out.c_str(), R_OK) != 0) {
+        if (model_file_type(model_path) == (int) ftype) {
+            LOG_INFO("%s already is %s", model_path.c_str(), format);
+            return "";
+        }
+
+        llama_model_quantize_params params = llama_model_quantize_default_params();
+        params.nthread = (int32_t) std::max(1u, std::thread::hardware_concurrency());
+        params.ftype = ftype;
+        params.allow_requantize = true; // the bundled models are already K-quantized
+
+        // Quantize into a private file so a killed process never leaves a partial variant
+        const auto t_start = Clock::now();
+        const std::string tmp = out + ".part";
+        if (llama_model_quantize(model_path.c_str(), tmp.c_str(), &params) != 0 ||
+            rename(tmp.c_str(), out.c_str()) != 0) {
+            LOG_ERROR("Failed to build %s variant of %s", format, model_path.c_str());
+            remove(tmp.c_str());
+            return "";
+        }
+        struct stat st{};
+        stat(out.c_str(), &st);
+        LOG_INFO("Built %s variant of %s in %ld ms: %s (%llu bytes)", format, model_path.c_str(),
+                 elapsed_ms(t_start, Clock::now()), out.c_str(), (unsigned long long) st.st_size);
+    }
+
+    std::lock_guard<std::mutex> lock(g_variant_mutex);
+    g_variants[model_path] = out;
+    return out;
+}
+
+// Builds optimized variants on one background thread, in request order.
+// llama_model_quantize cannot be interrupted, so a build in progress always
+// runs to the end.
+class VariantBuilder {
+private:
+    struct Request {
+        std::string path;
+        OptimizeCallback on_done;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Request> m_queue;
+    std::thread m_thread;
+    bool m_stop = false;
+
+    VariantBuilder() = default;
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) {
+                break;
+            }
+            Request req = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+
+            std::string variant;
+            try {
+                variant = build_variant(req.path);
+            } catch (const std::exception& e) {
+                LOG_ERROR("Exception while building model variant: %s", e.what());
+            }
+            if (req.on_done) {
+                req.on_done(variant);
+            }
+
+            lock.lock();
+        }
+    }
+
+public:
+    static VariantBuilder& instance() {
+        static VariantBuilder builder;
+        return builder;
+    }
+
+    ~VariantBuilder() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_queue.clear();
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void request(const std::string& path, OptimizeCallback on_done) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(Request{ path, std::move(on_done) });
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&VariantBuilder::loop, this);
+        }
+        m_cv.notify_one();
+    }
+};
+
+// Length of the longest prefix of `text` that does not end inside a UTF-8
+// sequence; a token piece can stop halfway through a multi-byte character
+static size_t utf8_complete_length(const std::string& text) {
+    size_t n = text.size();
+    size_t i = n;
+    while (i > 0 && n - i < 4 && (text[i - 1] & 0xC0) == 0x80) i--; // skip continuation bytes
+    if (i == 0) {
+        return n;
+    }
+    const unsigned char lead = (unsigned char) text[i - 1];
+    const size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return (n - (i - 1) < need) ? i - 1 : n;
+}
+
+// Coalesces a job's decoded output: a prompt's partial output is posted
+// after STREAM_EVERY_TOKENS new tokens or STREAM_EVERY_MS, and once more
+// when it finishes
+class TokenStream {
+private:
+    int64_t m_job_id;
+    StreamCallback m_post;
+    std::vector<int> m_sent_tokens; // per prompt, tokens covered by the last chunk
+    Clock::time_point m_last_post;
+
+public:
+    TokenStream(int64_t job_id, size_t n_items, StreamCallback post)
+            : m_job_id(job_id), m_post(std::move(post)), m_sent_tokens(n_items, 0), m_last_post(Clock::now()) {}
+
+    void on_step(const std::vector<SequenceState>& slots, int percent) {
+        const auto now = Clock::now();
+        const bool due = elapsed_ms(m_last_post, now) >= STREAM_EVERY_MS;
+        bool posted = false;
+
+        for (const auto& seq : slots) {
+            if (!seq.busy()) continue;
+
+            int& sent = m_sent_tokens[seq.item];
+            const int n_new = seq.result.generated_tokens - sent;
+            if (!seq.done && (n_new == 0 || (n_new < STREAM_EVERY_TOKENS && !due))) continue;
+
+            const std::string& out = seq.result.output;
+            m_post({ m_job_id, seq.item, out.substr(0, utf8_complete_length(out)), percent, seq.done });
+            sent = seq.result.generated_tokens;
+            posted = true;
+        }
+        if (posted) {
+            m_last_post = now;
+        }
+    }
+};
+
+// Asynchronous inference jobs. The caller submits prompts, polls state and
+// progress, and awaits or cancels the job. Jobs start in submission order on
+// one worker per threadpool lane, so independent jobs run concurrently.
+// Cancelling raises the job's flag, which the context's abort callback checks
+// between graph nodes, so an in-flight llama_decode stops promptly instead of
+// running the batch to completion.
+struct InferenceJob {
+    int64_t id = 0;
+    std::vector<std::string> prompts;
+    std::string model_path;
+    bool scoring = false;
+    bool stream = false;        // post partial output to the stream callback
+    std::atomic<bool> cancel{false};
+    std::atomic<int> state{JOB_QUEUED};
+    std::atomic<int> progress{0};
+    std::vector<InferenceResult> results; // one per prompt, set when finished
+    Clock::time_point finished_at;        // set with the final state, under the queue mutex
+};
+
+class JobQueue {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    std::deque<std::shared_ptr<InferenceJob>> m_queue;
+    std::unordered_map<int64_t, std::shared_ptr<InferenceJob>> m_jobs;
+    std::vector<std::thread> m_workers;
+    StreamCallback m_stream_callback;
+    bool m_stop = false;
+    int64_t m_next_id = 1;
+
+    JobQueue() = default;
+
+    static void run(InferenceJob& job, const StreamCallback& post) {
+        const size_t n = job.prompts.size();
+
+        std::call_once(g_backend_init_flag, initialize_backend);
+
+        std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(job.model_path);
+        if (!loaded) {
+            job.results = error_results(n, "Failed to load model or create context");
+            return;
+        }
+        ContextLease lease(loaded);
+        if (job.cancel.load()) {
+            job.results = error_results(n, "Cancelled");
+            return;
+        }
+        if (!lease) {
+            job.results = error_results(n, "Failed to load model or create context");
+            return;
+        }
+
+        // The lease clears the abort flag when the context goes back to the pool
+        lease->ctx.set_abort_flag(&job.cancel);
+
+        try {
+            if (job.scoring) {
+                job.results.resize(n);
+                for (size_t i = 0; i < n; i++) {
+                    if (job.cancel.load()) {
+                        job.results[i].error = "Cancelled";
+                    } else {
+                        job.results[i] = run_scoring(*lease, job.prompts[i]);
+                    }
+                    job.progress.store((int) ((i + 1) * 100 / n));
+                }
+            } else {
+                std::unique_ptr<TokenStream> stream;
+                if (job.stream && post) {
+                    stream.reset(new TokenStream(job.id, n, post));
+                }
+                auto on_progress = [&job, &stream](int percent, const std::vector<SequenceState>& slots) {
+                    job.progress.store(percent);
+                    if (stream) stream->on_step(slots, percent);
+                };
+                job.results = run_scheduler(*lease, job.prompts, on_progress, &job.cancel);
+            }
+        } catch (const std::exception& e) {
+            LOG_ERROR("Exception in job %lld: %s", (long long) job.id, e.what());
+            job.results = error_results(n, "Exception during inference: " + std::string(e.what()));
+        }
+
+        // A cancelled scoring run may have failed mid-decode with a generic error
+        if (job.cancel.load()) {
+            for (auto& r : job.results) {
+                if (!r.status().empty()) r.error = "Cancelled";
+            }
+        }
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_work_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) {
+                return;
+            }
+
+            std::shared_ptr<InferenceJob> job = m_queue.front();
+            m_queue.pop_front();
+            job->state.store(JOB_RUNNING);
+            const StreamCallback post = m_stream_callback;
+            lock.unlock();
+
+            LOG_INFO("Job %lld started: %zu prompts", (long long) job->id, job->prompts.size());
+            auto t_start = Clock::now();
+            run(*job, post);
+            LOG_INFO("Job %lld %s in %ld ms", (long long) job->id,
+                     job->cancel.load() ? "cancelled" : "finished", elapsed_ms(t_start, Clock::now()));
+
+            lock.lock();
+            job->finished_at = Clock::now();
+            if (job->cancel.load()) {
+                // A cancelled job's results are not wanted; an await already
+                // waiting on it holds its own reference
+                job->state.store(JOB_CANCELLED);
+                m_jobs.erase(job->id);
+            } else {
+                job->state.store(JOB_DONE);
+            }
+            m_done_cv.notify_all();
+        }
+    }
+
+    std::shared_ptr<InferenceJob> find_locked(int64_t id) {
+        auto it = m_jobs.find(id);
+        return it != m_jobs.end() ? it->second : nullptr;
+    }
+
+    // Forget finished jobs that nobody awaited within JOB_RESULT_TTL_MS
+    void expire_locked(Clock::time_point now) {
+        for (auto it = m_jobs.begin(); it != m_jobs.end();) {
+            const InferenceJob& job = *it->second;
+            if (job.state.load() >= JOB_DONE && elapsed_ms(job.finished_at, now) >= JOB_RESULT_TTL_MS) {
+                LOG_WARN("Job %lld expired without being awaited", (long long) job.id);
+                it = m_jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+public:
+    static JobQueue& instance() {
+        static JobQueue queue;
+        return queue;
+    }
+
+    ~JobQueue() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            for (auto& it : m_jobs) it.second->cancel.store(true);
+        }
+        m_work_cv.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    void set_stream_callback(StreamCallback callback) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stream_callback = std::move(callback);
+    }
+
+    int64_t submit(std::vector<std::string> prompts, const std::string& model_path, bool scoring, bool stream) {
+        auto job = std::make_shared<InferenceJob>();
+        job->prompts = std::move(prompts);
+        job->model_path = model_path;
+        job->scoring = scoring;
+        job->stream = stream && !scoring;
+
+        const int n_lanes = ThreadPools::instance().n_lanes();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        expire_locked(Clock::now());
+        if ((int) m_workers.size() < n_lanes) {
+            m_workers.emplace_back(&JobQueue::worker_loop, this);
+        }
+        job->id = m_next_id++;
+        m_jobs[job->id] = job;
+        m_queue.push_back(job);
+        m_work_cv.notify_one();
+        return job->id;
+    }
+
+    // Job state, or -1 for an unknown id; `progress` receives 0-100
+    int poll(int64_t id, int* progress) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::shared_ptr<InferenceJob> job = find_locked(id);
+        if (!job) {
+            return -1;
+        }
+        if (progress) *progress = job->progress.load();
+        return job->state.load();
+    }
+
+    // Request cancellation. Queued jobs finish immediately; a running job
+    // stops at its next graph node. Cancelled jobs are forgotten once they
+    // stop: await() may still be used to wait for that, and then returns
+    // false if the job has already gone.
+    bool cancel(int64_t id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::shared_ptr<InferenceJob> job = find_locked(id);
+        if (!job) {
+            return false;
+        }
+        job->cancel.store(true);
+
+        auto queued = std::find(m_queue.begin(), m_queue.end(), job);
+        if (queued != m_queue.end()) {
+            m_queue.erase(queued);
+            job->results = error_results(job->prompts.size(), "Cancelled");
+            job->finished_at = Clock::now();
+            job->state.store(JOB_CANCELLED);
+            m_jobs.erase(id);
+            m_done_cv.notify_all();
+        }
+        return true;
+    }
+
+    void cancel_all() {
+        std::vector<int64_t> ids;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& it : m_jobs) ids.push_back(it.first);
+        }
+        for (int64_t id : ids) cancel(id);
+    }
+
+    // Wait up to `timeout_ms` (< 0: forever) for the job to finish, then hand
+    // its results to `out` and forget it. Returns false on timeout or unknown
+    // id (including cancelled jobs that have stopped and expired results).
+    bool await(int64_t id, long timeout_ms, std::vector<InferenceResult>& out) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::shared_ptr<InferenceJob> job = find_locked(id);
+        if (!job) {
+            return false;
+        }
+
+        auto finished = [&job] { return job->state.load() >= JOB_DONE; };
+        if (timeout_ms < 0) {
+            m_done_cv.wait(lock, finished);
+        } else if (!m_done_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), finished)) {
+            return false;
+        }
+
+        out = std::move(job->results);
+        m_jobs.erase(id);
+        return true;
+    }
+};
+
+InferenceEngine& InferenceEngine::instance() {
+    static InferenceEngine engine;
+    return engine;
+}
+
+void InferenceEngine::set_model_budget(uint64_t bytes) {
+    ModelRegistry::instance().set_budget(bytes);
+}
+
+// Pooled contexts pick up the new prefix path and tuned config at checkout
+void InferenceEngine::set_state_dir(const std::string& dir) {
+    ModelRegistry::instance().set_state_dir(dir);
+}
+
+void InferenceEngine::set_prefix_boundary(const std::string& boundary) {
+    std::lock_guard<std::mutex> lock(g_boundary_mutex);
+    g_prefix_boundary = boundary;
+}
+
+void InferenceEngine::set_grammar_constrained(bool enabled) {
+    g_grammar_enabled.store(enabled);
+}
+
+void InferenceEngine::set_residency_policy(const ResidencyPolicy& policy) {
+    std::lock_guard<std::mutex> lock(g_residency_mutex);
+    g_residency_policy = policy;
+}
+
+ModelResidency InferenceEngine::model_residency(const std::string& model_path) {
+    const MappingStats stats = file_mapping_stats(model_path);
+    ModelResidency r;
+    r.mapped_bytes = stats.size_bytes;
+    r.resident_bytes = stats.resident_bytes;
+    r.locked_bytes = stats.locked_bytes;
+    return r;
+}
+
+void InferenceEngine::set_kv_cache_type(KvCacheType type) {
+    g_kv_cache_type.store(type);
+}
+
+void InferenceEngine::set_thread_config(int n_lanes, int n_decode, int n_prefill) {
+    ThreadPools::instance().configure(n_lanes, n_decode, n_prefill);
+}
+
+void InferenceEngine::set_stream_callback(StreamCallback callback) {
+    JobQueue::instance().set_stream_callback(std::move(callback));
+}
+
+// Prompts are scheduled over MAX_PARALLEL_SEQS slots of one pooled context;
+// checking it out only waits when every threadpool lane is serving another request
+std::vector<InferenceResult> InferenceEngine::infer(
+        const std::vector<std::string>& prompts,
+        const std::string& model_path,
+        const ProgressCallback& on_progress) {
+
+    // Initialize backend once
+    std::call_once(g_backend_init_flag, initialize_backend);
+
+    LOG_INFO("Starting inference of %zu prompts with model: %s", prompts.size(), model_path.c_str());
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(model_path);
+    if (!loaded) {
+        return error_results(prompts.size(), "Failed to load model or create context");
+    }
+    ContextLease lease(loaded);
+    if (!lease) {
+        return error_results(prompts.size(), "Failed to load model or create context");
+    }
+
+    std::function<void(int, const std::vector<SequenceState>&)> on_step;
+    if (on_progress) {
+        on_step = [&on_progress](int percent, const std::vector<SequenceState>&) { on_progress(percent); };
+    }
+    std::vector<InferenceResult> results = run_scheduler(*lease, prompts, on_step);
+
+    if (results.size() == 1) {
+        const InferenceResult& result = results[0];
+        const PhaseTimings& t = result.timings;
+        LOG_INFO("Inference complete: %d tokens generated in %ld us", result.generated_tokens, t.total_us);
+        LOG_INFO("Final metrics: ITPS=%ld, OTPS=%ld, TTFT=%ldus, prefill=%ldus, decode=%ldus, sample=%ldus, detok=%ldus",
+                 result.itps, result.otps, t.ttft_us, t.prefill_us, t.decode_us, t.sample_us, t.detok_us);
+        LOG_INFO("Inter-token latency: p50=%ldus p95=%ldus max=%ldus",
+                 t.itl_p50_us, t.itl_p95_us, t.itl_max_us);
+    }
+    return results;
+}
+
+InferenceResult InferenceEngine::score(const std::string& prompt, const std::string& model_path) {
+    std::call_once(g_backend_init_flag, initialize_backend);
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(model_path);
+    if (!loaded) {
+        return error_results(1, "Failed to load model or create context")[0];
+    }
+    ContextLease lease(loaded);
+    if (!lease) {
+        return error_results(1, "Failed to load model or create context")[0];
+    }
+    return run_scoring(*lease, prompt);
+}
+
+std::string InferenceEngine::tune(const std::string& model_path, bool force) {
+    std::call_once(g_backend_init_flag, initialize_backend);
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(model_path);
+    if (!loaded) {
+        return "ERROR|Failed to load model or create context";
+    }
+    ContextLease lease(loaded, true);
+    if (!lease) {
+        return "ERROR|Failed to load model or create context";
+    }
+    return run_tuning(lease, force);
+}
+
+std::vector<StageStats> InferenceEngine::benchmark_stages(const std::string& model_path, int n_prompt_tokens,
+                                                          int iterations) {
+    std::call_once(g_backend_init_flag, initialize_backend);
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(model_path);
+    if (!loaded) {
+        return {};
+    }
+    ContextLease lease(loaded);
+    if (!lease || n_prompt_tokens < 1 || iterations < 1) {
+        return {};
+    }
+    return run_stage_benchmark(*lease, n_prompt_tokens, iterations);
+}
+
+int64_t InferenceEngine::submit(std::vector<std::string> prompts, const std::string& model_path,
+                                bool scoring, bool stream) {
+    return JobQueue::instance().submit(std::move(prompts), model_path, scoring, stream);
+}
+
+int InferenceEngine::poll(int64_t id, int* progress) {
+    return JobQueue::instance().poll(id, progress);
+}
+
+bool InferenceEngine::cancel(int64_t id) {
+    return JobQueue::instance().cancel(id);
+}
+
+void InferenceEngine::cancel_all() {
+    JobQueue::instance().cancel_all();
+}
+
+bool InferenceEngine::await(int64_t id, long timeout_ms, std::vector<InferenceResult>& out) {
+    return JobQueue::instance().await(id, timeout_ms, out);
+}
+
+void InferenceEngine::preload(const std::string& model_path, ProgressCallback on_progress,
+                              PreloadCallback on_done) {
+    Preloader::instance().request(model_path, std::move(on_progress), std::move(on_done));
+}
+
+std::string InferenceEngine::optimized_format() {
+    llama_ftype ftype;
+    const char* format = ::optimized_format(&ftype);
+    return format ? format : "";
+}
+
+std::string InferenceEngine::build_optimized_variant(const std::string& model_path) {
+    std::call_once(g_backend_init_flag, initialize_backend);
+    return build_variant(model_path);
+}
+
+void InferenceEngine::optimize_model(const std::string& model_path, OptimizeCallback on_done) {
+    std::call_once(g_backend_init_flag, initialize_backend);
+    VariantBuilder::instance().request(model_path, std::move(on_done));
+}
+
+void InferenceEngine::set_use_optimized_variants(bool enabled) {
+    g_use_variants.store(enabled);
+}
+
+uint64_t InferenceEngine::trim(TrimLevel level) {
+    uint64_t rss_before = 0, rss = 0, peak = 0;
+    process_rss_bytes(&rss_before, &peak);
+
+    const size_t n_contexts = ModelRegistry::instance().release_contexts();
+    if (level >= TRIM_CRITICAL) {
+        // A preload would only bring the model straight back
+        Preloader::instance().cancel();
+        ModelRegistry::instance().unload_all();
+    }
+    release_free_heap();
+
+    process_rss_bytes(&rss, &peak);
+    const uint64_t released = rss_before > rss ? rss_before - rss : 0;
+    LOG_INFO("Trimmed (level %d): %zu contexts freed, RSS down %llu bytes to %llu bytes", (int) level, n_contexts,
+             (unsigned long long) released, (unsigned long long) rss);
+    return released;
+}
+
+void InferenceEngine::shutdown() {
+    Preloader::instance().cancel();
+    JobQueue::instance().cancel_all();
+    ModelRegistry::instance().clear();
+    if (g_backend_initialized.exchange(false)) {
+        // Note: llama_backend_free() might not be available in older versions
+        // Check if it exists before calling
+#ifdef HAVE_LLAMA_BACKEND_FREE
+        llama_backend_free();
+#endif
+        LOG_INFO("Native cleanup completed");
+    }
+}
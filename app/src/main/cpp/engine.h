@@ -0,0 +1,266 @@
+// engine.h
+// Platform-neutral allergen inference engine on top of llama.cpp. The JNI
+// library (native-lib.cpp) and the host benchmark both drive it through
+// InferenceEngine; nothing here depends on Android or the JVM.
+#pragma once
+
+#include "engine_log.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Target allergen labels, in bitmask order
+static const char* const ALLERGEN_LABELS[] = {
+        "milk", "egg", "peanut", "tree nut", "wheat", "soy", "fish", "shellfish", "sesame"
+};
+static const int N_ALLERGENS = sizeof(ALLERGEN_LABELS) / sizeof(ALLERGEN_LABELS[0]);
+
+// Phase timings of one prompt, in microseconds
+struct PhaseTimings {
+    long ttft_us = -1;
+    long prefill_us = 0;     // admission to the prompt's first logits, including prefix attach
+    long decode_us = 0;      // llama_decode steps that produced this prompt's output tokens
+    long sample_us = 0;
+    long detok_us = 0;
+    long total_us = 0;       // admission to the last token
+    long itl_p50_us = 0;     // inter-token latency distribution
+    long itl_p95_us = 0;
+    long itl_max_us = 0;
+    long perf_prompt_us = 0; // llama_perf_context of the whole run the prompt was decoded in
+    long perf_eval_us = 0;
+};
+
+// Native memory footprint when a prompt finished, in bytes
+struct MemoryStats {
+    uint64_t model_bytes = 0;          // llama_model_size: all weight tensors
+    uint64_t model_resident_bytes = 0; // mapped weight pages currently in RAM
+    uint64_t rss_bytes = 0;            // VmRSS
+    uint64_t peak_rss_bytes = 0;       // VmHWM, process lifetime peak
+};
+
+// Result of one prompt
+struct InferenceResult {
+    std::string output;
+    std::string error;
+    PhaseTimings timings;
+    MemoryStats memory;
+    long itps = 0;
+    long otps = 0;
+    int generated_tokens = 0;
+    int slot = 0;
+    int label_mask = 0;             // bit i set for ALLERGEN_LABELS[i]
+    std::vector<float> label_probs; // scoring mode only: P(yes) per label
+    std::string weights_path;       // GGUF file that served the prompt
+    std::string weights_format;     // optimized variant format, empty for the model as given
+
+    // Clear for the next prompt, keeping the buffers' capacity
+    void reset() {
+        output.clear();
+        error.clear();
+        timings = PhaseTimings();
+        memory = MemoryStats();
+        itps = 0;
+        otps = 0;
+        generated_tokens = 0;
+        slot = 0;
+        label_mask = 0;
+        label_probs.clear();
+        weights_path.clear();
+        weights_format.clear();
+    }
+
+    // Error to report for this prompt, empty on success
+    std::string status() const {
+        if (!error.empty()) {
+            return error;
+        }
+        if (generated_tokens == 0 && label_probs.empty()) {
+            return "No tokens generated";
+        }
+        return "";
+    }
+};
+
+// Allergen labels mentioned in `text`, as a bitmask. A label counts when it
+// appears as a whole word, case-insensitively.
+int decode_label_mask(const std::string& text);
+
+// Element type of the K and V caches. The quantized types shrink the KV
+// cache about 2x (q8_0) and 3.5x (q4_0) and need flash attention.
+enum KvCacheType {
+    KV_CACHE_F16 = 0,
+    KV_CACHE_Q8_0 = 1,
+    KV_CACHE_Q4_0 = 2
+};
+
+const char* kv_cache_type_name(KvCacheType type);
+
+// What happens to a model's mmap'd weights once it has loaded
+enum ResidencyMode {
+    RESIDENCY_LAZY = 0,     // pages fault in during the first decodes
+    RESIDENCY_WILLNEED = 1, // madvise(MADV_WILLNEED): the kernel reads ahead
+    RESIDENCY_PREFAULT = 2  // WILLNEED, and a helper thread touches every page
+};
+
+struct ResidencyPolicy {
+    ResidencyMode mode = RESIDENCY_WILLNEED;
+    bool lock_if_fits = false; // use_mlock when the weights leave as much RAM available again
+    bool hugepages = false;    // MADV_HUGEPAGE on the mappings; needs THP for files (Linux hosts)
+};
+
+// Residency of a model's mapped weights, in bytes
+struct ModelResidency {
+    uint64_t mapped_bytes = 0;
+    uint64_t resident_bytes = 0;
+    uint64_t locked_bytes = 0;
+
+    double resident_fraction() const {
+        return mapped_bytes ? (double) resident_bytes / (double) mapped_bytes : 0.0;
+    }
+};
+
+// How much native memory to give back under memory pressure
+enum TrimLevel {
+    TRIM_MODERATE = 1, // free KV caches, compute buffers and cached prefixes
+    TRIM_CRITICAL = 2  // also unload every model
+};
+
+// Timing distribution of one pipeline stage, in microseconds per call
+struct StageStats {
+    std::string stage;
+    int iterations = 0;
+    int ops_per_iteration = 1; // calls timed together in one iteration
+    double mean_us = 0;
+    double stddev_us = 0;
+    double min_us = 0;
+    double p50_us = 0;
+    double p90_us = 0;
+    double p99_us = 0;
+    double max_us = 0;
+};
+
+// A coalesced piece of streamed output: the partial text of one prompt
+struct StreamChunk {
+    int64_t job_id;
+    int item;
+    std::string text;
+    int percent;
+    bool done;
+};
+
+enum JobState {
+    JOB_QUEUED = 0,
+    JOB_RUNNING = 1,
+    JOB_DONE = 2,
+    JOB_CANCELLED = 3
+};
+
+// Percent of the generation budget decoded so far
+using ProgressCallback = std::function<void(int percent)>;
+
+// Outcome of a background preload
+using PreloadCallback = std::function<void(bool ok)>;
+
+// Path of a built optimized model variant, empty when there is none
+using OptimizeCallback = std::function<void(const std::string& variant_path)>;
+
+// Receives streamed output of jobs submitted with `stream`, on the decode thread
+using StreamCallback = std::function<void(StreamChunk chunk)>;
+
+// Entry point of the engine. Models stay resident between calls and every
+// method may be called from any thread; requests beyond the configured
+// number of lanes wait for a free one.
+class InferenceEngine {
+public:
+    static InferenceEngine& instance();
+
+    // Bytes of model weights that may stay resident between calls
+    void set_model_budget(uint64_t bytes);
+
+    // Directory where prefix states and tuned configs are persisted
+    void set_state_dir(const std::string& dir);
+
+    // Text that ends the shared part of every prompt (default "Ingredients
+    // to analyze:\n"). Only tokens up to it are cached as the prompt prefix;
+    // empty falls back to the common prefix of consecutive prompts.
+    void set_prefix_boundary(const std::string& boundary);
+
+    // Constrain generation to the allergen label grammar
+    void set_grammar_constrained(bool enabled);
+
+    // Residency policy of models loaded from now on
+    void set_residency_policy(const ResidencyPolicy& policy);
+
+    // Current residency of a model's weights; zero when it is not mapped
+    ModelResidency model_residency(const std::string& model_path);
+
+    // KV cache type of contexts created or checked out from now on
+    void set_kv_cache_type(KvCacheType type);
+
+    // Lanes (concurrent requests) and threads per lane; 0 threads picks them
+    // from the CPU topology
+    void set_thread_config(int n_lanes, int n_decode, int n_prefill);
+
+    void set_stream_callback(StreamCallback callback);
+
+    // Generate for every prompt on the calling thread
+    std::vector<InferenceResult> infer(const std::vector<std::string>& prompts,
+                                       const std::string& model_path,
+                                       const ProgressCallback& on_progress = nullptr);
+
+    // Single-pass multi-label scoring of one prompt
+    InferenceResult score(const std::string& prompt, const std::string& model_path);
+
+    // Tune context settings for the model on this device; returns a
+    // KEY=VALUE summary, or an ERROR| message. A request that has to wait
+    // for a threadpool lane meanwhile preempts the sweep ("ERROR|Preempted").
+    std::string tune(const std::string& model_path, bool force);
+
+    // Time tokenization, prefill, one decode step, greedy sampling,
+    // detokenization and label decoding separately on a prompt of
+    // `n_prompt_tokens` tokens. Empty when the model cannot be loaded.
+    std::vector<StageStats> benchmark_stages(const std::string& model_path, int n_prompt_tokens, int iterations);
+
+    // Load `model_path` and run one warmup decode on a background thread, so
+    // the first request finds it resident and paged in. `on_progress` gets
+    // the load percentage and `on_done` the outcome, both on that thread. A
+    // newer preload replaces a pending one and aborts a load in progress.
+    void preload(const std::string& model_path, ProgressCallback on_progress, PreloadCallback on_done);
+
+    // Asynchronous jobs: submit, then poll and finally await the results
+    int64_t submit(std::vector<std::string> prompts, const std::string& model_path, bool scoring, bool stream);
+    int poll(int64_t id, int* progress);
+    bool cancel(int64_t id);
+    void cancel_all();
+    bool await(int64_t id, long timeout_ms, std::vector<InferenceResult>& out);
+
+    // Weight format that decodes faster than the bundled K-quants on this
+    // CPU, from ggml's CPU feature checks; empty when there is none
+    std::string optimized_format();
+
+    // Requantize `model_path` into optimized_format() with every core, once,
+    // and cache the variant next to the original (in the state directory
+    // when that is read-only). Returns the variant's path; empty when the CPU
+    // has no better format, the model already is in it, or quantizing fails.
+    std::string build_optimized_variant(const std::string& model_path);
+
+    // build_optimized_variant() on a background thread; `on_done` runs there
+    void optimize_model(const std::string& model_path, OptimizeCallback on_done);
+
+    // Load a model's optimized variant in its place once one has been built
+    // (default off). A resident original is replaced at its next request.
+    // Results name the weights that served them (weights_format).
+    void set_use_optimized_variants(bool enabled);
+
+    // Give native memory back under pressure. Everything is rebuilt lazily
+    // by the next request; memory a running request holds is freed when it
+    // finishes. Returns how far RSS dropped right away, in bytes.
+    uint64_t trim(TrimLevel level);
+
+    // Cancel every job and free all resident models
+    void shutdown();
+
+private:
+    InferenceEngine() = default;
+};
@@ -0,0 +1,26 @@
+// engine_log.h
+#pragma once
+
+enum class LogLevel {
+    Info,
+    Warn,
+    Error
+};
+
+// Destination of the engine's log lines. The JNI library routes them to
+// logcat; with no sink installed they go to stderr.
+class LogSink {
+public:
+    virtual ~LogSink() = default;
+    virtual void write(LogLevel level, const char* message) = 0;
+};
+
+// Install `sink` for all later log lines; nullptr restores stderr.
+// The sink must outlive every thread that may still log.
+void set_log_sink(LogSink* sink);
+
+void log_message(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_INFO(...) log_message(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) log_message(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) log_message(LogLevel::Error, __VA_ARGS__)
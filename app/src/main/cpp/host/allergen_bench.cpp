@@ -0,0 +1,363 @@
+// allergen_bench.cpp
+// Host benchmark: runs a GGUF model over foodpreprocessed.csv through the same
+// engine and prompt format as the app, and prints per-item and aggregate
+// latency, throughput and accuracy. With -k the dataset is run once per KV
+// cache type and the types are compared on KV bytes, OTPS and F1; with -q the
+// device-optimized requantization of the model is compared with the original.
+#include "engine.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct FoodItem {
+    std::string id;
+    std::string name;
+    std::string ingredients;
+    std::string allergens_mapped;
+};
+
+// Writes warnings and errors, and info lines only with -v
+class StderrLogSink : public LogSink {
+public:
+    bool verbose = false;
+
+    void write(LogLevel level, const char* message) override {
+        if (level == LogLevel::Info && !verbose) return;
+        fprintf(stderr, "%s\n", message);
+    }
+};
+
+static const char* SYSTEM_MESSAGE =
+        "You are a strict Food Safety Officer. \n"
+        "Analyze the ingredients list and extract ONLY allergens from this specific list: \n"
+        "[milk, egg, peanut, tree nut, wheat, soy, fish, shellfish, sesame].\n"
+        "\n"
+        "Reference Guide (Derived Ingredients Mapping):\n"
+        "- milk: butter, cheese, cream, yogurt, whey, casein, lactose, ghee\n"
+        "- egg: egg white, egg yolk, albumin, mayonnaise, meringue\n"
+        "- peanut: peanut butter, arachis oil, goober\n"
+        "- tree nut: almond, walnut, cashew, pecan, pistachio, macadamia, hazelnut\n"
+        "- wheat: flour, semolina, bread crumbs, gluten, spelt, couscous, durum\n"
+        "- soy: soy sauce, tofu, soy protein, edamame, lecithin, miso, tempeh\n"
+        "- fish: salmon, tuna, cod, anchovy, bass, tilapia\n"
+        "- shellfish: shrimp, crab, lobster, prawn, clam, oyster, scallop\n"
+        "- sesame: tahini, sesame oil, benne seeds, za'atar\n"
+        "\n"
+        "Rules:\n"
+        "1. Identify allergens by direct mention OR by matching any item from the Reference Guide.\n"
+        "2. Output ONLY detected allergens from the target list (e.g., \"milk, wheat\").\n"
+        "3. Format the output as a lowercase, comma-separated list.\n"
+        "4. If no allergens are found, output exactly: EMPTY\n"
+        "5. NEVER include explanations, preambles, or extra text.";
+
+static bool contains_ignore_case(const std::string& text, const char* needle) {
+    auto it = std::search(text.begin(), text.end(), needle, needle + strlen(needle),
+                          [](char a, char b) { return tolower((unsigned char) a) == tolower((unsigned char) b); });
+    return it != text.end();
+}
+
+// Same chat formats as MainActivity.buildPrompt, picked by model filename
+static std::string build_prompt(const std::string& model_path, const std::string& ingredients) {
+    const std::string sys = SYSTEM_MESSAGE;
+    const std::string user = "Ingredients to analyze:\n" + ingredients;
+    const std::string file = model_path.substr(model_path.find_last_of('/') + 1);
+
+    if (contains_ignore_case(file, "qwen")) {
+        return "<|im_start|>system\n" + sys + "<|im_end|>\n<|im_start|>user\n" + user +
+               "<|im_end|>\n<|im_start|>assistant\n";
+    }
+    if (contains_ignore_case(file, "Phi")) {
+        return "<|user|>\n" + sys + "\n\n" + user + "<|end|>\n<|assistant|>\n";
+    }
+    if (contains_ignore_case(file, "Llama-3")) {
+        return "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n\n" + sys + "<|eot_id|>" +
+               "<|start_header_id|>user<|end_header_id|>\n\n" + user + "<|eot_id|>" +
+               "<|start_header_id|>assistant<|end_header_id|>\n";
+    }
+    if (contains_ignore_case(file, "Gemma")) {
+        return "<start_of_turn>user\n" + sys + "\n\n" + user + "<end_of_turn>\n<start_of_turn>model\n";
+    }
+    return "[INST] " + sys + " \n\n " + user + " [/INST]\n";
+}
+
+// Quote-aware split, as in CsvReader.parseCsvLine
+static std::vector<std::string> parse_csv_line(const std::string& line) {
+    std::vector<std::string> tokens;
+    std::string current;
+    bool in_quotes = false;
+    for (char c : line) {
+        if (c == '"') {
+            in_quotes = !in_quotes;
+        } else if (c == ',' && !in_quotes) {
+            tokens.push_back(current);
+            current.clear();
+        } else {
+            current += c;
+        }
+    }
+    tokens.push_back(current);
+    return tokens;
+}
+
+static std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+}
+
+static std::vector<FoodItem> read_food_items(const std::string& path) {
+    std::vector<FoodItem> items;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line); // Skip the header row
+    while (std::getline(in, line)) {
+        if (trim(line).empty()) continue;
+        std::vector<std::string> cols = parse_csv_line(line);
+        if (cols.size() < 5) continue;
+        items.push_back({ trim(cols[0]), trim(cols[1]), trim(cols[3]), cols.size() > 5 ? trim(cols[5]) : "" });
+    }
+    return items;
+}
+
+static int popcount(int mask) {
+    int n = 0;
+    for (; mask; mask &= mask - 1) n++;
+    return n;
+}
+
+static long percentile(std::vector<long> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t) (p * (double) (values.size() - 1) + 0.5)];
+}
+
+// Aggregates of one pass over the dataset
+struct RunSummary {
+    std::string weights; // "original" or the optimized format
+    KvCacheType kv = KV_CACHE_F16;
+    int n_scored = 0;
+    int n_failed = 0;
+    long otps_p50 = 0;
+    double f1 = 0;
+    double exact = 0;
+};
+
+// Run every item through the engine, printing one line per item and the
+// aggregate latency, throughput and accuracy
+static RunSummary run_dataset(InferenceEngine& engine, const std::vector<FoodItem>& items,
+                              const std::string& model_path, const std::string& load_path, size_t batch) {
+    printf("id\tttft_ms\titps\totps\ttokens\tprecision\trecall\tf1\texact\tpredicted\texpected\n");
+
+    RunSummary run;
+    std::vector<long> ttft_us;
+    std::vector<long> itps;
+    std::vector<long> otps;
+    double sum_precision = 0, sum_recall = 0, sum_f1 = 0, sum_hamming = 0;
+    int n_exact = 0;
+
+    for (size_t start = 0; start < items.size(); start += batch) {
+        const size_t end = std::min(items.size(), start + batch);
+        std::vector<std::string> prompts;
+        for (size_t i = start; i < end; i++) {
+            prompts.push_back(build_prompt(model_path, items[i].ingredients));
+        }
+
+        std::vector<InferenceResult> results = engine.infer(prompts, load_path);
+
+        for (size_t i = start; i < end; i++) {
+            const FoodItem& item = items[i];
+            const InferenceResult& r = results[i - start];
+            const std::string status = r.status();
+            if (!status.empty()) {
+                printf("%s\tERROR: %s\n", item.id.c_str(), status.c_str());
+                run.n_failed++;
+                continue;
+            }
+
+            // Per-item metrics as in MetricsCalculator
+            const int truth = decode_label_mask(item.allergens_mapped);
+            const int tp = popcount(r.label_mask & truth);
+            const int fp = popcount(r.label_mask & ~truth);
+            const int fn = popcount(truth & ~r.label_mask);
+            const double precision = tp + fp > 0 ? (double) tp / (tp + fp) : 0.0;
+            const double recall = tp + fn > 0 ? (double) tp / (tp + fn) : 0.0;
+            const double f1 = 2 * tp + fp + fn > 0 ? 2.0 * tp / (2 * tp + fp + fn) : 0.0;
+            const bool exact = r.label_mask == truth;
+
+            sum_precision += precision;
+            sum_recall += recall;
+            sum_f1 += f1;
+            sum_hamming += (double) (fp + fn) / N_ALLERGENS;
+            n_exact += exact;
+            run.n_scored++;
+            ttft_us.push_back(r.timings.ttft_us);
+            itps.push_back(r.itps);
+            otps.push_back(r.otps);
+
+            printf("%s\t%.1f\t%ld\t%ld\t%d\t%.3f\t%.3f\t%.3f\t%d\t%s\t%s\n",
+                   item.id.c_str(), r.timings.ttft_us / 1000.0, r.itps, r.otps, r.generated_tokens,
+                   precision, recall, f1, (int) exact, trim(r.output).c_str(),
+                   item.allergens_mapped.empty() ? "empty" : item.allergens_mapped.c_str());
+            fflush(stdout);
+        }
+    }
+
+    printf("\nitems=%d failed=%d\n", run.n_scored, run.n_failed);
+    if (run.n_scored > 0) {
+        const int n = run.n_scored;
+        run.otps_p50 = percentile(otps, 0.5);
+        run.f1 = sum_f1 / n;
+        run.exact = (double) n_exact / n;
+        printf("TTFT ms:  first=%.1f p50=%.1f p95=%.1f\n", ttft_us.front() / 1000.0,
+               percentile(ttft_us, 0.5) / 1000.0, percentile(ttft_us, 0.95) / 1000.0);
+        printf("ITPS:     p50=%ld p95=%ld\n", percentile(itps, 0.5), percentile(itps, 0.95));
+        printf("OTPS:     p50=%ld p95=%ld\n", run.otps_p50, percentile(otps, 0.95));
+        const ModelResidency residency = engine.model_residency(load_path);
+        printf("Weights:  %.1f%% of %llu mapped bytes resident, %llu locked\n",
+               100.0 * residency.resident_fraction(), (unsigned long long) residency.mapped_bytes,
+               (unsigned long long) residency.locked_bytes);
+        printf("Precision=%.4f Recall=%.4f F1=%.4f ExactMatch=%.4f HammingLoss=%.4f\n",
+               sum_precision / n, sum_recall / n, run.f1, run.exact, sum_hamming / n);
+    }
+    return run;
+}
+
+// "f16,q8_0,q4_0" to cache types; false on an unknown name
+static bool parse_kv_types(const std::string& arg, std::vector<KvCacheType>& types) {
+    types.clear();
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t end = arg.find(',', start);
+        if (end == std::string::npos) end = arg.size();
+        const std::string name = arg.substr(start, end - start);
+        bool found = false;
+        for (KvCacheType t : { KV_CACHE_F16, KV_CACHE_Q8_0, KV_CACHE_Q4_0 }) {
+            if (name == kv_cache_type_name(t)) {
+                types.push_back(t);
+                found = true;
+            }
+        }
+        if (!found) return false;
+        start = end + 1;
+    }
+    return !types.empty();
+}
+
+// "lazy", "willneed" or "prefault"; false on an unknown name
+static bool parse_residency_mode(const std::string& arg, ResidencyMode& mode) {
+    static const char* const NAMES[] = { "lazy", "willneed", "prefault" };
+    for (int m = RESIDENCY_LAZY; m <= RESIDENCY_PREFAULT; m++) {
+        if (arg == NAMES[m]) {
+            mode = (ResidencyMode) m;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [-d foodpreprocessed.csv] [-n N] [-b BATCH] [-t THREADS] [-k KV] [-q] [-r MODE] [-L] [-H] [-v]\n"
+            "  -n N        only the first N items\n"
+            "  -b BATCH    prompts per engine call (default 1)\n"
+            "  -t THREADS  threads for decode and prefill (default: from CPU topology)\n"
+            "  -k KV       KV cache types to compare, e.g. f16,q8_0,q4_0 (default f16)\n"
+            "  -q          also run the requantized variant optimized for this CPU\n"
+            "  -r MODE     weights after load: lazy, willneed or prefault (default willneed)\n"
+            "  -L          mlock the weights when they fit twice into available memory\n"
+            "  -H          madvise(MADV_HUGEPAGE) on the weight mappings\n"
+            "  -v          engine info logging\n", argv0);
+}
+
+int main(int argc, char** argv) {
+    std::string model_path;
+    std::string csv_path = "app/src/main/assets/foodpreprocessed.csv";
+    size_t limit = 0;
+    size_t batch = 1;
+    int n_threads = 0;
+    std::vector<KvCacheType> kv_types = { KV_CACHE_F16 };
+    ResidencyPolicy residency;
+    bool optimized = false;
+    StderrLogSink sink;
+
+    for (int i = 1; i < argc; i++) {
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "-m") && has_value) model_path = argv[++i];
+        else if (!strcmp(argv[i], "-d") && has_value) csv_path = argv[++i];
+        else if (!strcmp(argv[i], "-n") && has_value) limit = (size_t) atol(argv[++i]);
+        else if (!strcmp(argv[i], "-b") && has_value) batch = std::max(1L, atol(argv[++i]));
+        else if (!strcmp(argv[i], "-t") && has_value) n_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-k") && has_value && parse_kv_types(argv[++i], kv_types)) continue;
+        else if (!strcmp(argv[i], "-r") && has_value && parse_residency_mode(argv[++i], residency.mode)) continue;
+        else if (!strcmp(argv[i], "-q")) optimized = true;
+        else if (!strcmp(argv[i], "-L")) residency.lock_if_fits = true;
+        else if (!strcmp(argv[i], "-H")) residency.hugepages = true;
+        else if (!strcmp(argv[i], "-v")) sink.verbose = true;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (model_path.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    set_log_sink(&sink);
+
+    std::vector<FoodItem> items = read_food_items(csv_path);
+    if (items.empty()) {
+        fprintf(stderr, "No food items read from %s\n", csv_path.c_str());
+        return 1;
+    }
+    if (limit > 0 && limit < items.size()) {
+        items.resize(limit);
+    }
+
+    InferenceEngine& engine = InferenceEngine::instance();
+    engine.set_thread_config(1, n_threads, n_threads);
+    engine.set_residency_policy(residency);
+    // Each run loads exactly the weights it names
+    engine.set_use_optimized_variants(false);
+
+    std::vector<std::pair<std::string, std::string>> weights = { { "original", model_path } };
+    if (optimized) {
+        const std::string format = engine.optimized_format();
+        const std::string variant = engine.build_optimized_variant(model_path);
+        if (!variant.empty()) {
+            weights.emplace_back(format, variant);
+        } else {
+            fprintf(stderr, "No optimized variant for this CPU (%s), running the original only\n",
+                    format.empty() ? "no faster format" : format.c_str());
+        }
+    }
+
+    std::vector<RunSummary> runs;
+    int n_failed = 0;
+    for (const auto& w : weights) {
+        for (KvCacheType kv : kv_types) {
+            engine.set_kv_cache_type(kv);
+            printf("# Weights %s, KV cache %s\n", w.first.c_str(), kv_cache_type_name(kv));
+            runs.push_back(run_dataset(engine, items, model_path, w.second, batch));
+            runs.back().weights = w.first;
+            runs.back().kv = kv;
+            n_failed += runs.back().n_failed;
+            printf("\n");
+        }
+    }
+
+    if (runs.size() > 1) {
+        printf("weights\tkv\totps_p50\tf1\texact\tfailed\n");
+        for (const RunSummary& run : runs) {
+            printf("%s\t%s\t%ld\t%.4f\t%.4f\t%d\n", run.weights.c_str(), kv_cache_type_name(run.kv),
+                   run.otps_p50, run.f1, run.exact, run.n_failed);
+        }
+    }
+
+    engine.shutdown();
+    return n_failed > 0 ? 2 : 0;
+}
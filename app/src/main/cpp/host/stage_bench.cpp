@@ -0,0 +1,128 @@
+// stage_bench.cpp
+// Micro-benchmarks of each inference stage, per model and prompt length,
+// written as JSON so runs can be diffed and compared by scripts.
+#include "engine.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Warnings and errors only; the stages log every call at info level
+class StderrLogSink : public LogSink {
+public:
+    void write(LogLevel level, const char* message) override {
+        if (level == LogLevel::Info) return;
+        fprintf(stderr, "%s\n", message);
+    }
+};
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+static std::vector<int> parse_int_list(const char* arg) {
+    std::vector<int> values;
+    for (const char* p = arg; *p; ) {
+        char* end = nullptr;
+        long v = strtol(p, &end, 10);
+        if (end == p) break;
+        if (v > 0) values.push_back((int) v);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [-m MODEL2.gguf ...] [-p 32,128,512] [-i ITERATIONS] [-t THREADS] [-o OUT.json]\n"
+            "  -p LENGTHS     prompt lengths in tokens (default 32,128,512)\n"
+            "  -i ITERATIONS  timed runs per stage (default 20)\n"
+            "  -t THREADS     threads for decode and prefill (default: from CPU topology)\n"
+            "  -o OUT.json    write the report here instead of stdout\n", argv0);
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> models;
+    std::vector<int> prompt_lengths = { 32, 128, 512 };
+    int iterations = 20;
+    int n_threads = 0;
+    const char* out_path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "-m") && has_value) models.push_back(argv[++i]);
+        else if (!strcmp(argv[i], "-p") && has_value) prompt_lengths = parse_int_list(argv[++i]);
+        else if (!strcmp(argv[i], "-i") && has_value) iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && has_value) n_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && has_value) out_path = argv[++i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (models.empty() || prompt_lengths.empty() || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    StderrLogSink sink;
+    set_log_sink(&sink);
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot open %s\n", out_path);
+        return 1;
+    }
+
+    InferenceEngine& engine = InferenceEngine::instance();
+    engine.set_thread_config(1, n_threads, n_threads);
+
+    int n_failed = 0;
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"threads\": %d,\n  \"runs\": [", iterations, n_threads);
+    bool first_run = true;
+    for (const std::string& model : models) {
+        for (int n_prompt : prompt_lengths) {
+            fprintf(stderr, "%s, %d prompt tokens\n", model.c_str(), n_prompt);
+            std::vector<StageStats> stages = engine.benchmark_stages(model, n_prompt, iterations);
+            if (stages.empty()) {
+                fprintf(stderr, "  failed\n");
+                n_failed++;
+                continue;
+            }
+
+            fprintf(out, "%s\n    {\n      \"model\": \"%s\",\n      \"prompt_tokens\": %d,\n      \"stages\": [",
+                    first_run ? "" : ",", json_escape(model).c_str(), n_prompt);
+            first_run = false;
+            for (size_t i = 0; i < stages.size(); i++) {
+                const StageStats& st = stages[i];
+                fprintf(out, "%s\n        {\"stage\": \"%s\", \"iterations\": %d, \"ops_per_iteration\": %d, "
+                             "\"mean_us\": %.3f, \"stddev_us\": %.3f, \"min_us\": %.3f, \"p50_us\": %.3f, "
+                             "\"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+                        i == 0 ? "" : ",", st.stage.c_str(), st.iterations, st.ops_per_iteration,
+                        st.mean_us, st.stddev_us, st.min_us, st.p50_us, st.p90_us, st.p99_us, st.max_us);
+            }
+            fprintf(out, "\n      ]\n    }");
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    engine.shutdown();
+    return n_failed > 0 ? 2 : 0;
+}
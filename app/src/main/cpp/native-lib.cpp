@@ -1,402 +1,776 @@
 // native-lib.cpp
-#include "llama.h"
-#include <vector>
+// JNI bindings for MainActivity. The inference itself lives in engine.cpp;
+// this file converts between Java and engine types and forwards callbacks.
+#include "engine.h"
 #include <jni.h>
-#include <string>
-#include <cstring>
 #include <android/log.h>
-#include <chrono>
-#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <chrono>
 
 #define LOG_TAG "SLM_NATIVE"
-#define LOG_INFO(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOG_ERROR(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOG_WARN(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
-
-// Global variables for single initialization
-static std::once_flag g_backend_init_flag;
-static std::atomic<bool> g_backend_initialized{false};
-static std::mutex g_inference_mutex; // Mutex for thread-safe inference
-
-// Simple RAII wrapper for llama_context
-class LlamaContext {
-private:
-    llama_context* m_ctx;
-    llama_model* m_model;
 
+// Routes engine log lines to logcat
+class AndroidLogSink : public LogSink {
 public:
-    LlamaContext(const char* model_path, int n_ctx, int n_threads)
-            : m_ctx(nullptr), m_model(nullptr) {
-
-        llama_model_params model_params = llama_model_default_params();
-        model_params.n_gpu_layers = 0; // Set to 0 for CPU-only on Android
-        m_model = llama_model_load_from_file(model_path, model_params);
+    void write(LogLevel level, const char* message) override {
+        const int priority = level == LogLevel::Error ? ANDROID_LOG_ERROR
+                           : level == LogLevel::Warn ? ANDROID_LOG_WARN
+                           : ANDROID_LOG_INFO;
+        __android_log_write(priority, LOG_TAG, message);
+    }
+};
 
-        if (!m_model) {
-            LOG_ERROR("Failed to load model: %s", model_path);
+static AndroidLogSink g_android_log_sink;
+
+// Minimum gap between progress upcalls of a synchronous inferAllergens
+static const long PROGRESS_EVERY_MS = 100;
+
+// JVM handles cached once in JNI_OnLoad, so native threads can call back into
+// MainActivity without per-request class or method lookups
+static JavaVM* g_jvm = nullptr;
+static jclass g_activity_class = nullptr;            // global ref
+static jmethodID g_on_native_stream = nullptr;       // static onNativeStream(JILjava/lang/String;IZ)V
+static jmethodID g_update_native_progress = nullptr; // updateNativeProgress(I)V
+static jmethodID g_on_model_load = nullptr;          // static onModelLoad(Ljava/lang/String;IZZ)V
+static jmethodID g_on_model_optimized = nullptr;     // static onModelOptimized(Ljava/lang/String;Ljava/lang/String;)V
+
+// NativeResult class, constructor and field IDs, also cached in JNI_OnLoad
+static jclass g_result_class = nullptr;               // global ref
+static jmethodID g_result_ctor = nullptr;
+static struct {
+    jfieldID error, ttft_ms, itps, otps, oet_ms, generated_tokens, slot, label_mask, label_probs, output;
+    jfieldID ttft_us, prefill_us, decode_us, sample_us, detok_us, total_us;
+    jfieldID itl_p50_us, itl_p95_us, itl_max_us, perf_prompt_us, perf_eval_us;
+    jfieldID model_bytes, model_resident_bytes, rss_bytes, peak_rss_bytes;
+    jfieldID weights_path, weights_format;
+} g_result_fields;
+
+// Delivers stream chunks to MainActivity.onNativeStream from its own
+// JVM-attached thread, so JNI upcalls never run on the decode thread
+class StreamDispatcher {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<StreamChunk> m_queue;
+    std::thread m_thread;
+    bool m_stop = false;
+
+    StreamDispatcher() = default;
+
+    void loop() {
+        JNIEnv* env = nullptr;
+        if (g_jvm->AttachCurrentThread(&env, nullptr) != JNI_OK) {
+            LOG_ERROR("Stream thread failed to attach to the JVM");
             return;
         }
 
-        llama_context_params ctx_params = llama_context_default_params();
-        ctx_params.n_ctx = n_ctx;
-        ctx_params.n_threads = n_threads;
-        ctx_params.n_threads_batch = n_threads;
-
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                break; // stopped and drained
+            }
+            StreamChunk chunk = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+
+            jstring text = env->NewStringUTF(chunk.text.c_str());
+            env->CallStaticVoidMethod(g_activity_class, g_on_native_stream, (jlong) chunk.job_id,
+                                      (jint) chunk.item, text, (jint) chunk.percent,
+                                      (jboolean) (chunk.done ? JNI_TRUE : JNI_FALSE));
+            if (env->ExceptionCheck()) {
+                LOG_WARN("onNativeStream threw; exception cleared");
+                env->ExceptionClear();
+            }
+            env->DeleteLocalRef(text);
 
-        m_ctx = llama_init_from_model(m_model, ctx_params);
-        if (!m_ctx) {
-            LOG_ERROR("Failed to create context for model: %s", model_path);
-            llama_free_model(m_model);
-            m_model = nullptr;
-        } else {
-            LOG_INFO("Context created successfully with n_ctx=%d", n_ctx);
+            lock.lock();
         }
+
+        g_jvm->DetachCurrentThread();
     }
 
-    ~LlamaContext() {
-        if (m_ctx) {
-            llama_free(m_ctx);
-            LOG_INFO("Context freed");
+public:
+    static StreamDispatcher& instance() {
+        static StreamDispatcher dispatcher;
+        return dispatcher;
+    }
+
+    ~StreamDispatcher() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
         }
-        if (m_model) {
-            llama_free_model(m_model);
-            LOG_INFO("Model freed");
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
         }
     }
 
-    operator bool() const { return m_ctx != nullptr; }
+    void post(StreamChunk chunk) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&StreamDispatcher::loop, this);
+        }
+        m_queue.push_back(std::move(chunk));
+        m_cv.notify_one();
+    }
+};
 
-    llama_context* get() { return m_ctx; }
-    llama_model* get_model() { return m_model; }
+// JNIEnv of the calling native thread, attached to the JVM on first use and
+// detached when the thread exits
+static JNIEnv* attached_env() {
+    struct Attachment {
+        JNIEnv* env = nullptr;
+        ~Attachment() {
+            if (env) g_jvm->DetachCurrentThread();
+        }
+    };
+    static thread_local Attachment attachment;
+    if (!attachment.env && g_jvm->AttachCurrentThread(&attachment.env, nullptr) != JNI_OK) {
+        attachment.env = nullptr;
+    }
+    return attachment.env;
+}
 
-    // Disable copy
-    LlamaContext(const LlamaContext&) = delete;
-    LlamaContext& operator=(const LlamaContext&) = delete;
-};
+// Report preload progress to MainActivity.onModelLoad from the preload thread
+static void post_model_load(const std::string& path, int percent, bool done, bool ok) {
+    JNIEnv* env = g_on_model_load ? attached_env() : nullptr;
+    if (!env) {
+        return;
+    }
+    jstring jpath = env->NewStringUTF(path.c_str());
+    env->CallStaticVoidMethod(g_activity_class, g_on_model_load, jpath, (jint) percent,
+                              (jboolean) (done ? JNI_TRUE : JNI_FALSE), (jboolean) (ok ? JNI_TRUE : JNI_FALSE));
+    if (env->ExceptionCheck()) {
+        LOG_WARN("onModelLoad threw; exception cleared");
+        env->ExceptionClear();
+    }
+    env->DeleteLocalRef(jpath);
+}
 
-// Initialize llama backend (thread-safe, called once)
-static void initialize_backend() {
-    if (!g_backend_initialized.exchange(true)) {
-        llama_backend_init(); // ✅ no arguments
-        LOG_INFO("Llama backend initialized");
+static void post_model_optimized(const std::string& path, const std::string& variant) {
+    JNIEnv* env = g_on_model_optimized ? attached_env() : nullptr;
+    if (!env) {
+        return;
+    }
+    jstring jpath = env->NewStringUTF(path.c_str());
+    jstring jvariant = env->NewStringUTF(variant.c_str());
+    env->CallStaticVoidMethod(g_activity_class, g_on_model_optimized, jpath, jvariant);
+    if (env->ExceptionCheck()) {
+        LOG_WARN("onModelOptimized threw; exception cleared");
+        env->ExceptionClear();
     }
+    env->DeleteLocalRef(jvariant);
+    env->DeleteLocalRef(jpath);
 }
 
+static InferenceResult error_result(const std::string& message) {
+    InferenceResult result;
+    result.error = message;
+    return result;
+}
 
-// Tokenize input with bounds checking
-static std::vector<llama_token> tokenize_input(llama_context* ctx, const std::string& prompt) {
-    const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(ctx));
-    if (!vocab) {
-        LOG_ERROR("Failed to get vocabulary");
-        return {};
+// Build a NativeResult from `r` with the cached field IDs. Metrics are set as
+// numbers and the output as raw bytes, so nothing is formatted or parsed.
+static jobject new_result_object(JNIEnv* env, const InferenceResult& r) {
+    jobject obj = env->NewObject(g_result_class, g_result_ctor);
+    if (!obj) {
+        return nullptr;
     }
 
-    // Reserve space (max 512 tokens for safety)
-    std::vector<llama_token> tokens(512);
+    const std::string status = r.status();
+    if (!status.empty()) {
+        jstring error = env->NewStringUTF(status.c_str());
+        env->SetObjectField(obj, g_result_fields.error, error);
+        env->DeleteLocalRef(error);
+        return obj;
+    }
 
-    int n_tokens = llama_tokenize(
-            vocab,
-            prompt.c_str(),
-            prompt.size(),
-            tokens.data(),
-            tokens.size(),
-            true,  // add_bos
-            false  // special
-    );
+    const PhaseTimings& t = r.timings;
+    env->SetLongField(obj, g_result_fields.ttft_ms, (jlong) (t.ttft_us < 0 ? -1 : t.ttft_us / 1000));
+    env->SetLongField(obj, g_result_fields.itps, (jlong) r.itps);
+    env->SetLongField(obj, g_result_fields.otps, (jlong) r.otps);
+    env->SetLongField(obj, g_result_fields.oet_ms, (jlong) (t.total_us / 1000));
+    env->SetLongField(obj, g_result_fields.ttft_us, (jlong) t.ttft_us);
+    env->SetLongField(obj, g_result_fields.prefill_us, (jlong) t.prefill_us);
+    env->SetLongField(obj, g_result_fields.decode_us, (jlong) t.decode_us);
+    env->SetLongField(obj, g_result_fields.sample_us, (jlong) t.sample_us);
+    env->SetLongField(obj, g_result_fields.detok_us, (jlong) t.detok_us);
+    env->SetLongField(obj, g_result_fields.total_us, (jlong) t.total_us);
+    env->SetLongField(obj, g_result_fields.itl_p50_us, (jlong) t.itl_p50_us);
+    env->SetLongField(obj, g_result_fields.itl_p95_us, (jlong) t.itl_p95_us);
+    env->SetLongField(obj, g_result_fields.itl_max_us, (jlong) t.itl_max_us);
+    env->SetLongField(obj, g_result_fields.perf_prompt_us, (jlong) t.perf_prompt_us);
+    env->SetLongField(obj, g_result_fields.perf_eval_us, (jlong) t.perf_eval_us);
+
+    const MemoryStats& m = r.memory;
+    env->SetLongField(obj, g_result_fields.model_bytes, (jlong) m.model_bytes);
+    env->SetLongField(obj, g_result_fields.model_resident_bytes, (jlong) m.model_resident_bytes);
+    env->SetLongField(obj, g_result_fields.rss_bytes, (jlong) m.rss_bytes);
+    env->SetLongField(obj, g_result_fields.peak_rss_bytes, (jlong) m.peak_rss_bytes);
+    env->SetIntField(obj, g_result_fields.generated_tokens, (jint) r.generated_tokens);
+    env->SetIntField(obj, g_result_fields.slot, (jint) r.slot);
+    env->SetIntField(obj, g_result_fields.label_mask, (jint) r.label_mask);
+
+    if (!r.weights_path.empty()) {
+        jstring weights_path = env->NewStringUTF(r.weights_path.c_str());
+        env->SetObjectField(obj, g_result_fields.weights_path, weights_path);
+        env->DeleteLocalRef(weights_path);
+    }
+    if (!r.weights_format.empty()) {
+        jstring weights_format = env->NewStringUTF(r.weights_format.c_str());
+        env->SetObjectField(obj, g_result_fields.weights_format, weights_format);
+        env->DeleteLocalRef(weights_format);
+    }
 
-    if (n_tokens < 0) {
-        LOG_ERROR("Tokenization failed for prompt (size: %zu)", prompt.size());
-        return {};
+    if (!r.label_probs.empty()) {
+        jfloatArray probs = env->NewFloatArray((jsize) r.label_probs.size());
+        env->SetFloatArrayRegion(probs, 0, (jsize) r.label_probs.size(), r.label_probs.data());
+        env->SetObjectField(obj, g_result_fields.label_probs, probs);
+        env->DeleteLocalRef(probs);
     }
 
-    if (n_tokens == 0) {
-        LOG_ERROR("No tokens generated from prompt");
-        return {};
+    jbyteArray output = env->NewByteArray((jsize) r.output.size());
+    env->SetByteArrayRegion(output, 0, (jsize) r.output.size(), (const jbyte*) r.output.data());
+    env->SetObjectField(obj, g_result_fields.output, output);
+    env->DeleteLocalRef(output);
+    return obj;
+}
+
+static jobjectArray new_result_array(JNIEnv* env, const std::vector<InferenceResult>& results) {
+    jobjectArray array = env->NewObjectArray((jsize) results.size(), g_result_class, nullptr);
+    for (size_t i = 0; i < results.size(); i++) {
+        jobject obj = new_result_object(env, results[i]);
+        env->SetObjectArrayElement(array, (jsize) i, obj);
+        env->DeleteLocalRef(obj);
     }
+    return array;
+}
 
-    if (n_tokens > 512) {
-        LOG_ERROR("Prompt too long: %d tokens (max 512)", n_tokens);
-        return {};
+// Cache the NativeResult layout and the MainActivity class and callback
+// method IDs. FindClass only sees app classes from threads started by Java,
+// so this cannot be done lazily from the native worker threads.
+extern "C" JNIEXPORT jint JNICALL
+JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv((void**) &env, JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    g_jvm = vm;
+    set_log_sink(&g_android_log_sink);
+
+    jclass result_cls = env->FindClass("edu/utem/ftmk/slm02/NativeResult");
+    if (!result_cls) {
+        env->ExceptionClear();
+        LOG_ERROR("NativeResult class not found");
+        return JNI_ERR;
+    }
+    g_result_class = (jclass) env->NewGlobalRef(result_cls);
+    env->DeleteLocalRef(result_cls);
+
+    g_result_ctor = env->GetMethodID(g_result_class, "<init>", "()V");
+    g_result_fields.error = env->GetFieldID(g_result_class, "error", "Ljava/lang/String;");
+    g_result_fields.ttft_ms = env->GetFieldID(g_result_class, "ttftMs", "J");
+    g_result_fields.itps = env->GetFieldID(g_result_class, "itps", "J");
+    g_result_fields.otps = env->GetFieldID(g_result_class, "otps", "J");
+    g_result_fields.oet_ms = env->GetFieldID(g_result_class, "oetMs", "J");
+    g_result_fields.generated_tokens = env->GetFieldID(g_result_class, "generatedTokens", "I");
+    g_result_fields.slot = env->GetFieldID(g_result_class, "slot", "I");
+    g_result_fields.label_mask = env->GetFieldID(g_result_class, "labelMask", "I");
+    g_result_fields.label_probs = env->GetFieldID(g_result_class, "labelProbs", "[F");
+    g_result_fields.output = env->GetFieldID(g_result_class, "output", "[B");
+    g_result_fields.ttft_us = env->GetFieldID(g_result_class, "ttftUs", "J");
+    g_result_fields.prefill_us = env->GetFieldID(g_result_class, "prefillUs", "J");
+    g_result_fields.decode_us = env->GetFieldID(g_result_class, "decodeUs", "J");
+    g_result_fields.sample_us = env->GetFieldID(g_result_class, "sampleUs", "J");
+    g_result_fields.detok_us = env->GetFieldID(g_result_class, "detokenizeUs", "J");
+    g_result_fields.total_us = env->GetFieldID(g_result_class, "totalUs", "J");
+    g_result_fields.itl_p50_us = env->GetFieldID(g_result_class, "itlP50Us", "J");
+    g_result_fields.itl_p95_us = env->GetFieldID(g_result_class, "itlP95Us", "J");
+    g_result_fields.itl_max_us = env->GetFieldID(g_result_class, "itlMaxUs", "J");
+    g_result_fields.perf_prompt_us = env->GetFieldID(g_result_class, "perfPromptUs", "J");
+    g_result_fields.perf_eval_us = env->GetFieldID(g_result_class, "perfEvalUs", "J");
+    g_result_fields.model_bytes = env->GetFieldID(g_result_class, "modelBytes", "J");
+    g_result_fields.model_resident_bytes = env->GetFieldID(g_result_class, "modelResidentBytes", "J");
+    g_result_fields.rss_bytes = env->GetFieldID(g_result_class, "rssBytes", "J");
+    g_result_fields.peak_rss_bytes = env->GetFieldID(g_result_class, "peakRssBytes", "J");
+    g_result_fields.weights_path = env->GetFieldID(g_result_class, "weightsPath", "Ljava/lang/String;");
+    g_result_fields.weights_format = env->GetFieldID(g_result_class, "weightsFormat", "Ljava/lang/String;");
+    if (env->ExceptionCheck()) {
+        env->ExceptionClear();
+        LOG_ERROR("NativeResult does not match the native field layout");
+        return JNI_ERR;
     }
 
-    tokens.resize(n_tokens);
-    LOG_INFO("Tokenized %d tokens", n_tokens);
+    jclass activity_cls = env->FindClass("edu/utem/ftmk/slm02/MainActivity");
+    if (!activity_cls) {
+        env->ExceptionClear();
+        LOG_WARN("MainActivity class not found; streaming callbacks disabled");
+        return JNI_VERSION_1_6;
+    }
+    g_activity_class = (jclass) env->NewGlobalRef(activity_cls);
+    env->DeleteLocalRef(activity_cls);
+
+    g_on_native_stream = env->GetStaticMethodID(g_activity_class, "onNativeStream", "(JILjava/lang/String;IZ)V");
+    if (!g_on_native_stream) env->ExceptionClear();
+    g_update_native_progress = env->GetMethodID(g_activity_class, "updateNativeProgress", "(I)V");
+    if (!g_update_native_progress) env->ExceptionClear();
+    g_on_model_load = env->GetStaticMethodID(g_activity_class, "onModelLoad", "(Ljava/lang/String;IZZ)V");
+    if (!g_on_model_load) env->ExceptionClear();
+    g_on_model_optimized = env->GetStaticMethodID(g_activity_class, "onModelOptimized",
+                                                  "(Ljava/lang/String;Ljava/lang/String;)V");
+    if (!g_on_model_optimized) env->ExceptionClear();
+
+    if (g_on_native_stream) {
+        InferenceEngine::instance().set_stream_callback([](StreamChunk chunk) {
+            StreamDispatcher::instance().post(std::move(chunk));
+        });
+    }
 
-    return tokens;
+    LOG_INFO("JNI_OnLoad: stream callback %s, progress callback %s, model load callback %s",
+             g_on_native_stream ? "found" : "missing", g_update_native_progress ? "found" : "missing",
+             g_on_model_load ? "found" : "missing");
+    return JNI_VERSION_1_6;
 }
 
-// Main inference function
-static std::string run_inference(
+extern "C" JNIEXPORT jobject JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_inferAllergens(
         JNIEnv* env,
         jobject thiz,
-        const std::string& prompt,
-        const std::string& model_path,
-        bool report_progress) {
+        jstring input_prompt,
+        jstring model_path,
+        jboolean report_progress) {
+
+    LOG_INFO("Java inferAllergens called");
+
+    // Convert Java strings to C++ strings
+    const char* prompt_cstr = env->GetStringUTFChars(input_prompt, nullptr);
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
 
-    // Initialize backend once
-    std::call_once(g_backend_init_flag, initialize_backend);
+    if (!prompt_cstr || !path_cstr) {
+        LOG_ERROR("Failed to get Java string UTF chars");
+        if (prompt_cstr) env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
+        if (path_cstr) env->ReleaseStringUTFChars(model_path, path_cstr);
+        return new_result_object(env, error_result("Invalid input parameters"));
+    }
 
-    LOG_INFO("Starting inference with model: %s", model_path.c_str());
-    LOG_INFO("Prompt: %s", prompt.substr(0, 100).c_str()); // Log first 100 chars
+    std::string prompt(prompt_cstr);
+    std::string model_path_str(path_cstr);
 
-    // Lock for thread-safe inference (prevent multiple concurrent inferences)
-    std::unique_lock<std::mutex> lock(g_inference_mutex);
+    LOG_INFO("Running inference with prompt length: %zu, model path: %s",
+             prompt.length(), model_path_str.c_str());
 
-    // Load model and create context
-    LlamaContext ctx(model_path.c_str(), 512, 4);
-    if (!ctx) {
-        return "ERROR|Failed to load model or create context";
+    // Progress upcalls use the method ID cached in JNI_OnLoad. The engine
+    // reports about once per token, so like the stream dispatcher they are
+    // throttled to one per PROGRESS_EVERY_MS; 100% is always delivered
+    ProgressCallback on_progress;
+    if (report_progress && g_update_native_progress) {
+        on_progress = [env, thiz, last = -1,
+                       last_post = std::chrono::steady_clock::time_point()](int percent) mutable {
+            if (percent == last) return;
+            const auto now = std::chrono::steady_clock::now();
+            if (percent < 100 && now - last_post < std::chrono::milliseconds(PROGRESS_EVERY_MS)) return;
+            last = percent;
+            last_post = now;
+            env->CallVoidMethod(thiz, g_update_native_progress, percent);
+        };
     }
 
-    // Tokenize input
-    std::vector<llama_token> prompt_tokens = tokenize_input(ctx.get(), prompt);
-    if (prompt_tokens.empty()) {
-        return "ERROR|Tokenization failed";
+    // Run inference
+    InferenceResult result;
+    try {
+        result = InferenceEngine::instance().infer({prompt}, model_path_str, on_progress)[0];
+    } catch (const std::exception& e) {
+        LOG_ERROR("Exception during inference: %s", e.what());
+        result.error = "Exception during inference: " + std::string(e.what());
+    } catch (...) {
+        LOG_ERROR("Unknown exception during inference");
+        result.error = "Unknown exception during inference";
     }
 
-    int n_prompt = prompt_tokens.size();
+    // Release Java strings
+    env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
+    env->ReleaseStringUTFChars(model_path, path_cstr);
 
-    // Get JNI callback for progress updates
-    jclass activity_cls = nullptr;
-    jmethodID progress_method = nullptr;
-    if (report_progress) {
-        activity_cls = env->GetObjectClass(thiz);
-        if (activity_cls) {
-            progress_method = env->GetMethodID(activity_cls, "updateNativeProgress", "(I)V");
-        }
-    }
+    LOG_INFO("Inference completed, returning result");
+    return new_result_object(env, result);
+}
+
+// Scoring-mode variant of inferAllergens: one batched probe pass instead of generation
+extern "C" JNIEXPORT jobject JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_scoreAllergens(
+        JNIEnv* env,
+        jobject thiz,
+        jstring input_prompt,
+        jstring model_path) {
+
+    LOG_INFO("Java scoreAllergens called");
 
-    // Start timing for overall inference
-    auto t_inference_start = std::chrono::high_resolution_clock::now();
+    const char* prompt_cstr = env->GetStringUTFChars(input_prompt, nullptr);
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
 
-    // --- PROMPT PROCESSING ---
-    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
-    if (!batch.token) {
-        return "ERROR|Failed to allocate batch";
+    if (!prompt_cstr || !path_cstr) {
+        LOG_ERROR("Failed to get Java string UTF chars");
+        if (prompt_cstr) env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
+        if (path_cstr) env->ReleaseStringUTFChars(model_path, path_cstr);
+        return new_result_object(env, error_result("Invalid input parameters"));
     }
 
-    for (int i = 0; i < n_prompt; i++) {
-        batch.token[i] = prompt_tokens[i];
-        batch.pos[i] = i;
-        batch.seq_id[i][0] = 0;
-        batch.n_seq_id[i] = 1;
-        batch.logits[i] = (i == n_prompt - 1); // Logits only for last token
+    std::string prompt(prompt_cstr);
+    std::string model_path_str(path_cstr);
+    env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
+    env->ReleaseStringUTFChars(model_path, path_cstr);
+
+    InferenceResult result;
+    try {
+        result = InferenceEngine::instance().score(prompt, model_path_str);
+    } catch (const std::exception& e) {
+        LOG_ERROR("Exception during scoring: %s", e.what());
+        result.error = "Exception during inference: " + std::string(e.what());
+    } catch (...) {
+        LOG_ERROR("Unknown exception during scoring");
+        result.error = "Unknown exception during inference";
     }
-    batch.n_tokens = n_prompt;
 
-    LOG_INFO("Decoding prompt with %d tokens", n_prompt);
+    return new_result_object(env, result);
+}
 
-    // Decode prompt
-    int decode_result = llama_decode(ctx.get(), batch);
-    if (decode_result != 0) {
-        LOG_ERROR("Prompt decoding failed with code: %d", decode_result);
-        llama_batch_free(batch);
-        return "ERROR|Prompt decoding failed";
+// Batched variant of inferAllergens: returns one NativeResult per prompt
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_inferAllergensBatch(
+        JNIEnv* env,
+        jobject thiz,
+        jobjectArray input_prompts,
+        jstring model_path) {
+
+    LOG_INFO("Java inferAllergensBatch called");
+
+    const jsize n_prompts = env->GetArrayLength(input_prompts);
+    std::vector<std::string> prompts;
+    prompts.reserve(n_prompts);
+
+    for (jsize i = 0; i < n_prompts; i++) {
+        jstring prompt = (jstring) env->GetObjectArrayElement(input_prompts, i);
+        const char* prompt_cstr = prompt ? env->GetStringUTFChars(prompt, nullptr) : nullptr;
+        prompts.emplace_back(prompt_cstr ? prompt_cstr : "");
+        if (prompt_cstr) env->ReleaseStringUTFChars(prompt, prompt_cstr);
+        env->DeleteLocalRef(prompt);
     }
 
-    // Calculate prompt processing metrics
-    auto t_prompt_end = std::chrono::high_resolution_clock::now();
-    long prompt_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            t_prompt_end - t_inference_start).count();
-    long itps = (prompt_ms > 0) ? (n_prompt * 1000L) / prompt_ms : 0;
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
+    std::string model_path_str(path_cstr ? path_cstr : "");
+    if (path_cstr) env->ReleaseStringUTFChars(model_path, path_cstr);
 
-    LOG_INFO("Prompt processing: %ld ms, ITPS: %ld", prompt_ms, itps);
+    // Run inference
+    std::vector<InferenceResult> results;
+    try {
+        results = InferenceEngine::instance().infer(prompts, model_path_str);
+    } catch (const std::exception& e) {
+        LOG_ERROR("Exception during batch inference: %s", e.what());
+        results.assign(prompts.size(), error_result("Exception during inference: " + std::string(e.what())));
+    } catch (...) {
+        LOG_ERROR("Unknown exception during batch inference");
+        results.assign(prompts.size(), error_result("Unknown exception during inference"));
+    }
 
-    // --- TOKEN GENERATION ---
-    llama_sampler* sampler = llama_sampler_init_greedy();
-    if (!sampler) {
-        llama_batch_free(batch);
-        return "ERROR|Failed to create sampler";
+    LOG_INFO("Batch inference completed, returning %d results", (int) n_prompts);
+    return new_result_array(env, results);
+}
+
+// Queue prompts for asynchronous inference (or scoring) and return the job id.
+// With `stream`, partial output arrives through MainActivity.onNativeStream.
+extern "C" JNIEXPORT jlong JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_submitInference(
+        JNIEnv* env,
+        jobject thiz,
+        jobjectArray input_prompts,
+        jstring model_path,
+        jboolean scoring,
+        jboolean stream) {
+
+    const jsize n_prompts = env->GetArrayLength(input_prompts);
+    std::vector<std::string> prompts;
+    prompts.reserve(n_prompts);
+
+    for (jsize i = 0; i < n_prompts; i++) {
+        jstring prompt = (jstring) env->GetObjectArrayElement(input_prompts, i);
+        const char* prompt_cstr = prompt ? env->GetStringUTFChars(prompt, nullptr) : nullptr;
+        prompts.emplace_back(prompt_cstr ? prompt_cstr : "");
+        if (prompt_cstr) env->ReleaseStringUTFChars(prompt, prompt_cstr);
+        env->DeleteLocalRef(prompt);
     }
 
-    std::string output;
-    int generated_tokens = 0;
-    long ttft_ms = -1;
-    bool first_token_seen = false;
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
+    std::string model_path_str(path_cstr ? path_cstr : "");
+    if (path_cstr) env->ReleaseStringUTFChars(model_path, path_cstr);
 
-    auto t_gen_start = std::chrono::high_resolution_clock::now();
+    int64_t id = InferenceEngine::instance().submit(std::move(prompts), model_path_str,
+                                                    scoring == JNI_TRUE, stream == JNI_TRUE);
+    LOG_INFO("Submitted job %lld (%d prompts)", (long long) id, (int) n_prompts);
+    return (jlong) id;
+}
 
-    const int MAX_GEN_TOKENS = 32; // Reduced from 64 for stability
-    int n_pos = n_prompt;
+// Job state: 0 queued, 1 running, 2 done, 3 cancelled, -1 unknown id
+extern "C" JNIEXPORT jint JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_pollJob(
+        JNIEnv* env,
+        jobject thiz,
+        jlong job_id) {
 
-    // Get vocabulary for token conversion
-    const llama_vocab* vocab = llama_model_get_vocab(ctx.get_model());
+    return InferenceEngine::instance().poll(job_id, nullptr);
+}
 
-    while (generated_tokens < MAX_GEN_TOKENS) {
-        // Sample next token
-        llama_token token = llama_sampler_sample(sampler, ctx.get(), -1);
+// Progress of a job in percent of its generation budget
+extern "C" JNIEXPORT jint JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_jobProgress(
+        JNIEnv* env,
+        jobject thiz,
+        jlong job_id) {
 
-        // EOS check (OLD API)
-        if (token == llama_token_eos(vocab)) {
-            LOG_INFO("End of sequence token received");
-            break;
-        }
+    int progress = 0;
+    InferenceEngine::instance().poll(job_id, &progress);
+    return progress;
+}
 
-        // Time to first token
-        if (!first_token_seen) {
-            auto t_now = std::chrono::high_resolution_clock::now();
-            ttft_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    t_now - t_inference_start).count();
-            first_token_seen = true;
-            LOG_INFO("First token received at %ld ms", ttft_ms);
-        }
+extern "C" JNIEXPORT jboolean JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_cancelJob(
+        JNIEnv* env,
+        jobject thiz,
+        jlong job_id) {
 
-        // Token → text
-        char buffer[128];
+    return InferenceEngine::instance().cancel(job_id) ? JNI_TRUE : JNI_FALSE;
+}
 
-        int32_t n_chars = llama_token_to_piece(
-                vocab,                 // const llama_vocab *
-                token,                 // llama_token
-                buffer,                // char *
-                (int32_t)sizeof(buffer), // length
-                0,                     // lstrip (usually 0)
-                false                  // special tokens? false
-        );
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_cancelAllJobs(
+        JNIEnv* env,
+        jobject thiz) {
 
-        ;
+    LOG_INFO("Cancelling all inference jobs");
+    InferenceEngine::instance().cancel_all();
+}
 
-        if (n_chars > 0) {
-            output.append(buffer, n_chars);
-            LOG_INFO("Generated token %d: '%.*s'",
-                     generated_tokens + 1, n_chars, buffer);
+// Block until the job finishes (timeout_ms < 0 waits forever) and return one
+// NativeResult per prompt, or null on timeout or unknown id
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_awaitJob(
+        JNIEnv* env,
+        jobject thiz,
+        jlong job_id,
+        jlong timeout_ms) {
 
-            if (output.find('\n') != std::string::npos) {
-                LOG_INFO("Newline detected, stopping generation");
-                break;
-            }
-        } else if (n_chars < 0) {
-            LOG_ERROR("Failed to convert token to piece");
-            break;
-        }
+    std::vector<InferenceResult> results;
+    if (!InferenceEngine::instance().await(job_id, (long) timeout_ms, results)) {
+        return nullptr;
+    }
+    return new_result_array(env, results);
+}
 
-        generated_tokens++;
+// Free native memory under pressure (1 moderate, 2 critical); returns the RSS drop in bytes
+extern "C" JNIEXPORT jlong JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_trimNativeMemory(
+        JNIEnv* env,
+        jobject thiz,
+        jint level) {
 
-        // Progress callback
-        if (report_progress && progress_method) {
-            int percent = (generated_tokens * 100) / MAX_GEN_TOKENS;
-            env->CallVoidMethod(thiz, progress_method, percent);
-        }
+    if (level < TRIM_MODERATE || level > TRIM_CRITICAL) {
+        LOG_WARN("Ignoring unknown trim level: %d", (int) level);
+        return 0;
+    }
+    return (jlong) InferenceEngine::instance().trim((TrimLevel) level);
+}
 
-        // Decode next token
-        llama_batch_free(batch);
-        batch = llama_batch_init(1, 0, 1);
+// Optional: Cleanup function
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_cleanupNative(
+        JNIEnv* env,
+        jclass clazz) {
+
+    LOG_INFO("cleanupNative called");
+    InferenceEngine::instance().shutdown();
+}
 
-        batch.token[0] = token;
-        batch.pos[0] = n_pos++;
-        batch.seq_id[0][0] = 0;
-        batch.n_seq_id[0] = 1;
-        batch.logits[0] = true;
-        batch.n_tokens = 1;
+// Configure how many bytes of model weights may stay resident between calls
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setModelCacheBudget(
+        JNIEnv* env,
+        jobject thiz,
+        jlong budget_bytes) {
 
-        if (llama_decode(ctx.get(), batch) != 0) {
-            LOG_ERROR("Generation decoding failed");
-            break;
-        }
+    if (budget_bytes <= 0) {
+        LOG_WARN("Ignoring invalid model cache budget: %lld", (long long) budget_bytes);
+        return;
     }
+    InferenceEngine::instance().set_model_budget((uint64_t) budget_bytes);
+}
 
-    // Clean up sampler and batch
-    llama_sampler_free(sampler);
-    llama_batch_free(batch);
+// Directory where prompt prefix states are persisted across launches
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setStateCacheDir(
+        JNIEnv* env,
+        jobject thiz,
+        jstring dir) {
 
-    // Calculate final metrics
-    auto t_inference_end = std::chrono::high_resolution_clock::now();
+    const char* dir_cstr = env->GetStringUTFChars(dir, nullptr);
+    if (!dir_cstr) {
+        LOG_ERROR("Failed to get Java string UTF chars");
+        return;
+    }
+    InferenceEngine::instance().set_state_dir(dir_cstr);
+    env->ReleaseStringUTFChars(dir, dir_cstr);
+}
 
-    // Generation time only
-    long gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            t_inference_end - t_gen_start).count();
+// Load a model and warm it up on the native preload thread. Progress and the
+// outcome arrive through MainActivity.onModelLoad.
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_preloadModel(
+        JNIEnv* env,
+        jobject thiz,
+        jstring model_path) {
 
-    // Output tokens per second
-    long otps = (gen_ms > 0 && generated_tokens > 0) ?
-                (generated_tokens * 1000L) / gen_ms : 0;
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
+    if (!path_cstr) {
+        LOG_ERROR("Failed to get Java string UTF chars");
+        return;
+    }
+    std::string path(path_cstr);
+    env->ReleaseStringUTFChars(model_path, path_cstr);
 
-    // Overall evaluation time
-    long oet_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            t_inference_end - t_inference_start).count();
+    LOG_INFO("Preloading model: %s", path.c_str());
+    InferenceEngine::instance().preload(
+            path,
+            [path](int percent) { post_model_load(path, percent, false, false); },
+            [path](bool ok) { post_model_load(path, ok ? 100 : 0, true, ok); });
+}
 
-    LOG_INFO("Inference complete: %d tokens generated in %ld ms", generated_tokens, oet_ms);
-    LOG_INFO("Final metrics: ITPS=%ld, OTPS=%ld, TTFT=%ldms", itps, otps, ttft_ms);
+// Requantize a model into the faster weight format for this CPU on a native
+// background thread, once; later loads pick the variant automatically. The
+// outcome arrives through MainActivity.onModelOptimized.
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_optimizeModel(
+        JNIEnv* env,
+        jobject thiz,
+        jstring model_path) {
 
-    // Format result: METADATA|OUTPUT
-    std::string result;
-    if (generated_tokens > 0) {
-        result = "TTFT_MS=" + std::to_string(ttft_ms) +
-                 ";ITPS=" + std::to_string(itps) +
-                 ";OTPS=" + std::to_string(otps) +
-                 ";OET_MS=" + std::to_string(oet_ms) +
-                 ";GEN_TOKENS=" + std::to_string(generated_tokens) +
-                 "|" + output;
-    } else {
-        result = "ERROR|No tokens generated";
-    }
-
-    LOG_INFO("Result length: %zu characters", result.length());
-    return result;
+    const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
+    if (!path_cstr) {
+        LOG_ERROR("Failed to get Java string UTF chars");
+        return;
+    }
+    std::string path(path_cstr);
+    env->ReleaseStringUTFChars(model_path, path_cstr);
+
+    LOG_INFO("Optimizing model for this CPU: %s", path.c_str());
+    InferenceEngine::instance().optimize_model(
+            path,
+            [path](const std::string& variant) { post_model_optimized(path, variant); });
+}
+
+// Load optimized variants in place of the models they were built from
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setUseOptimizedVariants(
+        JNIEnv* env,
+        jobject thiz,
+        jboolean enabled) {
+
+    InferenceEngine::instance().set_use_optimized_variants(enabled == JNI_TRUE);
+    LOG_INFO("Optimized model variants %s", enabled ? "enabled" : "disabled");
 }
 
+// Toggle grammar-constrained allergen output
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setGrammarConstrained(
+        JNIEnv* env,
+        jobject thiz,
+        jboolean enabled) {
+
+    InferenceEngine::instance().set_grammar_constrained(enabled == JNI_TRUE);
+    LOG_INFO("Grammar-constrained decoding %s", enabled ? "enabled" : "disabled");
+}
+
+// Tune context settings for a model on this device. Unless `force` is set,
+// a config already tuned for this (model, CPU) pair is kept as is.
 extern "C" JNIEXPORT jstring JNICALL
-Java_edu_utem_ftmk_slm02_MainActivity_inferAllergens(
+Java_edu_utem_ftmk_slm02_MainActivity_tuneModel(
         JNIEnv* env,
         jobject thiz,
-        jstring input_prompt,
         jstring model_path,
-        jboolean report_progress) {
-
-    LOG_INFO("Java inferAllergens called");
+        jboolean force) {
 
-    // Convert Java strings to C++ strings
-    const char* prompt_cstr = env->GetStringUTFChars(input_prompt, nullptr);
     const char* path_cstr = env->GetStringUTFChars(model_path, nullptr);
-
-    if (!prompt_cstr || !path_cstr) {
+    if (!path_cstr) {
         LOG_ERROR("Failed to get Java string UTF chars");
-        if (prompt_cstr) env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
-        if (path_cstr) env->ReleaseStringUTFChars(model_path, path_cstr);
         return env->NewStringUTF("ERROR|Invalid input parameters");
     }
-
-    std::string prompt(prompt_cstr);
     std::string model_path_str(path_cstr);
+    env->ReleaseStringUTFChars(model_path, path_cstr);
 
-    LOG_INFO("Running inference with prompt length: %zu, model path: %s",
-             prompt.length(), model_path_str.c_str());
-
-    // Run inference
     std::string result;
     try {
-        result = run_inference(env, thiz, prompt, model_path_str, report_progress);
+        result = InferenceEngine::instance().tune(model_path_str, force == JNI_TRUE);
     } catch (const std::exception& e) {
-        LOG_ERROR("Exception during inference: %s", e.what());
-        result = "ERROR|Exception during inference: " + std::string(e.what());
-    } catch (...) {
-        LOG_ERROR("Unknown exception during inference");
-        result = "ERROR|Unknown exception during inference";
+        LOG_ERROR("Exception during tuning: %s", e.what());
+        result = "ERROR|Exception during tuning: " + std::string(e.what());
     }
 
-    // Release Java strings
-    env->ReleaseStringUTFChars(input_prompt, prompt_cstr);
-    env->ReleaseStringUTFChars(model_path, path_cstr);
-
-    LOG_INFO("Inference completed, returning result");
     return env->NewStringUTF(result.c_str());
 }
 
-// Optional: Cleanup function
+// KV cache element type: 0 f16, 1 q8_0, 2 q4_0
 extern "C" JNIEXPORT void JNICALL
-Java_edu_utem_ftmk_slm02_MainActivity_cleanupNative(
+Java_edu_utem_ftmk_slm02_MainActivity_setKvCacheType(
         JNIEnv* env,
-        jclass clazz) {
+        jobject thiz,
+        jint type) {
 
-    LOG_INFO("cleanupNative called");
-    if (g_backend_initialized.exchange(false)) {
-        // Note: llama_backend_free() might not be available in older versions
-        // Check if it exists before calling
-#ifdef HAVE_LLAMA_BACKEND_FREE
-        llama_backend_free();
-#endif
-        LOG_INFO("Native cleanup completed");
+    if (type < KV_CACHE_F16 || type > KV_CACHE_Q4_0) {
+        LOG_WARN("Ignoring unknown KV cache type: %d", (int) type);
+        return;
+    }
+    InferenceEngine::instance().set_kv_cache_type((KvCacheType) type);
+    LOG_INFO("KV cache type: %s", kv_cache_type_name((KvCacheType) type));
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setResidencyPolicy(
+        JNIEnv* env,
+        jobject thiz,
+        jint mode,
+        jboolean lockIfFits,
+        jboolean hugepages) {
+
+    if (mode < RESIDENCY_LAZY || mode > RESIDENCY_PREFAULT) {
+        LOG_WARN("Ignoring unknown residency mode: %d", (int) mode);
+        return;
     }
+    ResidencyPolicy policy;
+    policy.mode = (ResidencyMode) mode;
+    policy.lock_if_fits = lockIfFits;
+    policy.hugepages = hugepages;
+    InferenceEngine::instance().set_residency_policy(policy);
+    LOG_INFO("Residency policy: mode=%d lock_if_fits=%d hugepages=%d",
+             (int) mode, (int) policy.lock_if_fits, (int) policy.hugepages);
+}
+
+// Thread counts per lane for decode and prefill (0 picks them from the CPU
+// topology) and the number of lanes, i.e. requests that may run concurrently
+extern "C" JNIEXPORT void JNICALL
+Java_edu_utem_ftmk_slm02_MainActivity_setThreadConfig(
+        JNIEnv* env,
+        jobject thiz,
+        jint decode_threads,
+        jint prefill_threads,
+        jint context_pool_size) {
+
+    InferenceEngine::instance().set_thread_config(context_pool_size, decode_threads, prefill_threads);
+    LOG_INFO("Thread config: decode=%d prefill=%d (0 = auto) lanes=%d",
+             (int) decode_threads, (int) prefill_threads, (int) context_pool_size);
 }
 
 // Optional: Test function to verify llama is working
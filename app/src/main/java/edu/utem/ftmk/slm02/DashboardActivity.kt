@@ -117,7 +117,7 @@ class DashboardActivity : AppCompatActivity() {
         // 4. SECTION: EFFICIENCY METRICS
         // ==========================================
         sb.append("3. ON-DEVICE EFFICIENCY METRICS\n")
-        sb.append("Model,Latency (s),Total Time (s),TTFT (s),Input T/s,Output T/s,Eval Time (s),Java Heap (MB),Native Heap (MB),PSS (MB)\n")
+        sb.append("Model,Latency (s),Total Time (s),TTFT (s),Input T/s,Output T/s,Eval Time (s),Java Heap (MB),Native Heap (MB),PSS (MB),Model Size (MB),Peak RSS (MB)\n")
 
         for (row in currentBenchmarkData) {
             val model = (row["modelName"] as? String ?: "?").replace(".gguf", "")
@@ -130,6 +130,8 @@ class DashboardActivity : AppCompatActivity() {
             val java = (row["Java Heap (MB)"] as? Number)?.toDouble() ?: 0.0
             val nat = (row["Native Heap (MB)"] as? Number)?.toDouble() ?: 0.0
             val pss = (row["Proportional Set Size (MB)"] as? Number)?.toDouble() ?: 0.0
+            val weights = (row["Model Size (MB)"] as? Number)?.toDouble() ?: 0.0
+            val peakRss = (row["Peak RSS (MB)"] as? Number)?.toDouble() ?: 0.0
 
             sb.append("$model,")
             sb.append("${"%.2f".format(lat)},")
@@ -140,7 +142,9 @@ class DashboardActivity : AppCompatActivity() {
             sb.append("${"%.2f".format(oet)},")
             sb.append("${"%.1f".format(java)},")
             sb.append("${"%.1f".format(nat)},")
-            sb.append("${"%.1f".format(pss)}\n")
+            sb.append("${"%.1f".format(pss)},")
+            sb.append("${"%.1f".format(weights)},")
+            sb.append("${"%.1f".format(peakRss)}\n")
         }
 
         // ==========================================
@@ -227,7 +231,8 @@ class DashboardActivity : AppCompatActivity() {
 
     private fun populateEfficiencyTable(data: List<Map<String, Any>>) {
         tableEfficiency.removeAllViews()
-        val headers = listOf("Model", "Lat(s)", "Total(s)", "TTFT(s)", "ITPS(t/s)", "OTPS(t/s)", "OET(s)", "Java(MB)", "Nat(MB)", "PSS(MB)")
+        val headers = listOf("Model", "Lat(s)", "Total(s)", "TTFT(s)", "ITPS(t/s)", "OTPS(t/s)", "OET(s)", "Java(MB)", "Nat(MB)", "PSS(MB)",
+            "Model(MB)", "PeakRSS(MB)")
         addHeaderRow(tableEfficiency, headers)
 
         for (row in data) {
@@ -242,11 +247,14 @@ class DashboardActivity : AppCompatActivity() {
             val java = (row["Java Heap (MB)"] as? Number)?.toDouble() ?: 0.0
             val nat = (row["Native Heap (MB)"] as? Number)?.toDouble() ?: 0.0
             val pss = (row["Proportional Set Size (MB)"] as? Number)?.toDouble() ?: 0.0
+            val weights = (row["Model Size (MB)"] as? Number)?.toDouble() ?: 0.0
+            val peakRss = (row["Peak RSS (MB)"] as? Number)?.toDouble() ?: 0.0
 
             val values = listOf(
                 model, "%.2f".format(lat), "%.2f".format(total), "%.2f".format(ttft),
                 "%.1f".format(itps), "%.1f".format(otps), "%.2f".format(oet),
-                "%.1f".format(java), "%.1f".format(nat), "%.1f".format(pss)
+                "%.1f".format(java), "%.1f".format(nat), "%.1f".format(pss),
+                "%.1f".format(weights), "%.1f".format(peakRss)
             )
             addDataRow(tableEfficiency, values)
         }
@@ -38,8 +38,11 @@ class FirebaseService {
             val mapped = result.foodItem.allergensMapped
             val safeMapped = if (mapped.isNullOrEmpty() || mapped.equals("empty", ignoreCase = true)) "EMPTY" else mapped
 
+            val weightsFormat = result.metrics?.weightsFormat ?: "original"
             val data = hashMapOf<String, Any>(
                 "modelName" to modelName,
+                "weightsFormat" to weightsFormat,
+                "weightsPath" to (result.metrics?.weightsPath ?: ""),
                 "dataId" to result.foodItem.id,
                 "name" to result.foodItem.name,
                 "ingredients" to result.foodItem.ingredients,
@@ -78,17 +81,32 @@ class FirebaseService {
                     "Input Token Per Second (tokens/s)" to eff.itps.toDouble(),
                     "Output Token Per Second (tokens/s)" to eff.otps.toDouble(),
 
+                    // Native phase timings in milliseconds
+                    "Prefill Time (ms)" to (eff.prefillUs / 1000.0),
+                    "Decode Time (ms)" to (eff.decodeUs / 1000.0),
+                    "Sampling Time (ms)" to (eff.sampleUs / 1000.0),
+                    "Detokenize Time (ms)" to (eff.detokenizeUs / 1000.0),
+                    "Inter-Token Latency p50 (ms)" to (eff.itlP50Us / 1000.0),
+                    "Inter-Token Latency p95 (ms)" to (eff.itlP95Us / 1000.0),
+                    "Inter-Token Latency Max (ms)" to (eff.itlMaxUs / 1000.0),
+
                     // Memory metrics in MB
                     "Java Heap (MB)" to (eff.javaHeapKb / 1024.0),
                     "Native Heap (MB)" to (eff.nativeHeapKb / 1024.0),
-                    "Proportional Set Size (MB)" to (eff.totalPssKb / 1024.0)
+                    "Proportional Set Size (MB)" to (eff.totalPssKb / 1024.0),
+
+                    // Native memory accounting in MB
+                    "Model Size (MB)" to (eff.modelKb / 1024.0),
+                    "Model Resident (MB)" to (eff.modelResidentKb / 1024.0),
+                    "RSS (MB)" to (eff.rssKb / 1024.0),
+                    "Peak RSS (MB)" to (eff.peakRssKb / 1024.0)
                 )
             }
 
             collectionPrediction.add(data).await()
             Log.d("FIREBASE", "Individual Prediction Saved with Units.")
 
-            updateDashboardFromHistory(modelName)
+            updateDashboardFromHistory(modelName, weightsFormat)
 
         } catch (e: Exception) {
             Log.e("FIREBASE", "Error saving prediction: ${e.message}")
@@ -117,6 +135,8 @@ class FirebaseService {
 
                 val data = hashMapOf<String, Any>(
                     "modelName" to result.modelName,
+                    "weightsFormat" to (result.metrics?.weightsFormat ?: "original"),
+                    "weightsPath" to (result.metrics?.weightsPath ?: ""),
                     "dataId" to result.foodItem.id,
                     "name" to result.foodItem.name,
                     "ingredients" to result.foodItem.ingredients,
@@ -151,9 +171,20 @@ class FirebaseService {
                         "Output Eval Time (s)" to (eff.oet / 1000.0),
                         "Input Token Per Second (tokens/s)" to eff.itps.toDouble(),
                         "Output Token Per Second (tokens/s)" to eff.otps.toDouble(),
+                        "Prefill Time (ms)" to (eff.prefillUs / 1000.0),
+                        "Decode Time (ms)" to (eff.decodeUs / 1000.0),
+                        "Sampling Time (ms)" to (eff.sampleUs / 1000.0),
+                        "Detokenize Time (ms)" to (eff.detokenizeUs / 1000.0),
+                        "Inter-Token Latency p50 (ms)" to (eff.itlP50Us / 1000.0),
+                        "Inter-Token Latency p95 (ms)" to (eff.itlP95Us / 1000.0),
+                        "Inter-Token Latency Max (ms)" to (eff.itlMaxUs / 1000.0),
                         "Java Heap (MB)" to (eff.javaHeapKb / 1024.0),
                         "Native Heap (MB)" to (eff.nativeHeapKb / 1024.0),
-                        "Proportional Set Size (MB)" to (eff.totalPssKb / 1024.0)
+                        "Proportional Set Size (MB)" to (eff.totalPssKb / 1024.0),
+                        "Model Size (MB)" to (eff.modelKb / 1024.0),
+                        "Model Resident (MB)" to (eff.modelResidentKb / 1024.0),
+                        "RSS (MB)" to (eff.rssKb / 1024.0),
+                        "Peak RSS (MB)" to (eff.peakRssKb / 1024.0)
                     )
                 }
 
@@ -172,10 +203,11 @@ class FirebaseService {
     // PART 3: Dashboard Aggregation
     // =========================================================================
 
-    private suspend fun updateDashboardFromHistory(modelName: String) {
+    private suspend fun updateDashboardFromHistory(modelName: String, weightsFormat: String) {
         try {
             val snapshot = collectionPrediction.whereEqualTo("modelName", modelName).get().await()
-            val docs = snapshot.documents
+            // Aggregate only predictions from the same weights; older documents predate variants
+            val docs = snapshot.documents.filter { (it.getString("weightsFormat") ?: "original") == weightsFormat }
             if (docs.isEmpty()) return
 
             val count = docs.size.toDouble()
@@ -190,6 +222,8 @@ class FirebaseService {
             var sumLat = 0.0; var sumTotalTime = 0.0; var sumTtft = 0.0; var sumOet = 0.0
             var sumItps = 0.0; var sumOtps = 0.0
             var sumJavaMb = 0.0; var sumNativeMb = 0.0; var sumPssMb = 0.0
+            // Native footprint: the largest value any prediction reported, as in a batch run
+            var maxModelMb = 0.0; var maxPeakRssMb = 0.0
 
             for (doc in docs) {
                 val qualMap = doc.get("quality_metrics") as? Map<String, Any>
@@ -229,6 +263,8 @@ class FirebaseService {
                     sumJavaMb += (effMap["Java Heap (MB)"] as? Number)?.toDouble() ?: 0.0
                     sumNativeMb += (effMap["Native Heap (MB)"] as? Number)?.toDouble() ?: 0.0
                     sumPssMb += (effMap["Proportional Set Size (MB)"] as? Number)?.toDouble() ?: 0.0
+                    maxModelMb = maxOf(maxModelMb, (effMap["Model Size (MB)"] as? Number)?.toDouble() ?: 0.0)
+                    maxPeakRssMb = maxOf(maxPeakRssMb, (effMap["Peak RSS (MB)"] as? Number)?.toDouble() ?: 0.0)
                 }
             }
 
@@ -240,7 +276,9 @@ class FirebaseService {
                 modelName, sumPrecision/count, sumRecall/count, sumF1/count, sumEmr/count, sumHamming/count, sumFnr/count,
                 abstentionAccuracy, avgHallucinationRate, avgOverPredictionRate,
                 sumLat/count, sumTotalTime/count, sumTtft/count, sumItps/count, sumOtps/count, sumOet/count,
-                sumJavaMb/count, sumNativeMb/count, sumPssMb/count
+                sumJavaMb/count, sumNativeMb/count, sumPssMb/count,
+                modelMb = maxModelMb, peakRssMb = maxPeakRssMb,
+                weightsFormat = weightsFormat
             )
 
         } catch (e: Exception) {
@@ -253,20 +291,24 @@ class FirebaseService {
         avgPrecision: Double, avgRecall: Double, avgF1: Double, avgEmr: Double, avgHamming: Double, avgFnr: Double,
         abstentionAccuracy: Double, hallucinationRate: Double, overPredictionRate: Double,
         avgLatency: Double, avgTotalTime: Double, avgTtft: Double, avgItps: Double, avgOtps: Double, avgOet: Double,
-        avgJavaHeap: Double, avgNativeHeap: Double, avgPss: Double
+        avgJavaHeap: Double, avgNativeHeap: Double, avgPss: Double,
+        modelMb: Double = 0.0, peakRssMb: Double = 0.0,
+        weightsFormat: String = "original"
     ) {
         val timestamp = FieldValue.serverTimestamp()
+        // An optimized variant gets its own benchmark rows next to the original model's
+        val documentId = if (weightsFormat == "original") modelName else "$modelName ($weightsFormat)"
 
         val qualityData = hashMapOf(
             "modelName" to modelName, "Precision" to avgPrecision, "Recall" to avgRecall,
             "F1 Score" to avgF1, "Exact Match Ratio (%)" to avgEmr, "Hamming Loss" to avgHamming,
-            "False Negative Rate (%)" to avgFnr, "timestamp" to timestamp
+            "False Negative Rate (%)" to avgFnr, "weightsFormat" to weightsFormat, "timestamp" to timestamp
         )
 
         val safetyData = hashMapOf(
             "modelName" to modelName, "Abstention Accuracy (%)" to abstentionAccuracy,
             "Hallucination Rate (%)" to hallucinationRate, "Over-Prediction Rate (%)" to overPredictionRate,
-            "timestamp" to timestamp
+            "weightsFormat" to weightsFormat, "timestamp" to timestamp
         )
 
         // EFFICIENCY WITH UNITS (Already averaged)
@@ -281,13 +323,16 @@ class FirebaseService {
             "Java Heap (MB)" to avgJavaHeap,
             "Native Heap (MB)" to avgNativeHeap,
             "Proportional Set Size (MB)" to avgPss,
+            "Model Size (MB)" to modelMb,
+            "Peak RSS (MB)" to peakRssMb,
+            "weightsFormat" to weightsFormat,
             "timestamp" to timestamp
         )
 
         try {
-            val t1 = colQuality.document(modelName).set(qualityData)
-            val t2 = colSafety.document(modelName).set(safetyData)
-            val t3 = colEfficiency.document(modelName).set(efficiencyData)
+            val t1 = colQuality.document(documentId).set(qualityData)
+            val t2 = colSafety.document(documentId).set(safetyData)
+            val t3 = colEfficiency.document(documentId).set(efficiencyData)
             Tasks.whenAll(t1, t2, t3).await()
             Log.d("FIREBASE", "Benchmark tables saved.")
         } catch (e: Exception) {
@@ -325,7 +370,9 @@ class FirebaseService {
                     val metrics = if (effMap != null) {
                         InferenceMetrics(
                             latencyMs = ((effMap["Latency (s)"] as? Number)?.toDouble() ?: 0.0 * 1000).toLong(),
-                            javaHeapKb = 0, nativeHeapKb = 0, totalPssKb = 0, ttft = 0, itps = 0, otps = 0, oet = 0
+                            javaHeapKb = 0, nativeHeapKb = 0, totalPssKb = 0, ttft = 0, itps = 0, otps = 0, oet = 0,
+                            weightsFormat = doc.getString("weightsFormat") ?: "original",
+                            weightsPath = doc.getString("weightsPath") ?: ""
                         )
                     } else null
 
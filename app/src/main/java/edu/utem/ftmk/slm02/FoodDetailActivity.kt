@@ -49,7 +49,7 @@ class FoodDetailActivity : AppCompatActivity() {
             "EMPTY" else food.allergensMapped
 
         // 3. Predicted (Updated with Model Name)
-        findViewById<TextView>(R.id.tvDetailModelName).text = result.modelName
+        findViewById<TextView>(R.id.tvDetailModelName).text = result.modelLabel()
         findViewById<TextView>(R.id.tvDetailMappedAllergens).text = mappedAllergens
         findViewById<TextView>(R.id.tvDetailPredicted).text = result.predictedAllergens ?: "No Prediction"
 
@@ -53,7 +53,7 @@ class HistoryDetailActivity : AppCompatActivity() {
 
         // 3. Predicted
         // Clean up the model name if needed, or just use result.modelName like FoodDetailActivity
-        findViewById<TextView>(R.id.tvDetailModelName).text = result.modelName
+        findViewById<TextView>(R.id.tvDetailModelName).text = result.modelLabel()
         findViewById<TextView>(R.id.tvDetailMappedAllergens).text = mappedAllergens
         findViewById<TextView>(R.id.tvDetailPredicted).text = result.predictedAllergens ?: "No Prediction"
 
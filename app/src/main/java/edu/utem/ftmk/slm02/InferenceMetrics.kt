@@ -25,6 +25,32 @@ data class InferenceMetrics (
     val ttft: Long,
     val itps: Long,
     val otps: Long,
-    val oet: Long
+    val oet: Long,
+
+    // Native phase timings in microseconds
+    val prefillUs: Long = 0,
+    val decodeUs: Long = 0,
+    val sampleUs: Long = 0,
+    val detokenizeUs: Long = 0,
+
+    // Inter-token latency distribution in microseconds
+    val itlP50Us: Long = 0,
+    val itlP95Us: Long = 0,
+    val itlMaxUs: Long = 0,
+
+    // llama.cpp prompt/eval timers of the native run, in microseconds
+    val perfPromptUs: Long = 0,
+    val perfEvalUs: Long = 0,
+
+    // Native memory accounting in KB: weights (total and resident) and
+    // process RSS (current and peak)
+    val modelKb: Long = 0,
+    val modelResidentKb: Long = 0,
+    val rssKb: Long = 0,
+    val peakRssKb: Long = 0,
+
+    // Weights that produced the result: "original" or the optimized variant format, and its file
+    val weightsFormat: String = "original",
+    val weightsPath: String = ""
 
 ) : Parcelable // 4. Implement Interface
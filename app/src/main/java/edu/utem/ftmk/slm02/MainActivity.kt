@@ -5,6 +5,10 @@ package edu.utem.ftmk.slm02
 
 import android.Manifest
 
+import android.app.ActivityManager
+
+import android.content.ComponentCallbacks2
+
 import android.content.Context
 
 import android.content.Intent
@@ -29,13 +33,20 @@ import androidx.core.content.ContextCompat
 
 import androidx.lifecycle.lifecycleScope
 
+import kotlinx.coroutines.CancellationException
+
 import kotlinx.coroutines.Dispatchers
 
+import kotlinx.coroutines.delay
+
 import kotlinx.coroutines.launch
 
 import kotlinx.coroutines.withContext
 
 import java.io.File
+import java.io.IOException
+
+import java.util.concurrent.ConcurrentHashMap
 
 
 
@@ -45,6 +56,91 @@ class MainActivity : AppCompatActivity() {
 
     companion object {
 
+        // Prompts queued per native call during batch prediction. The native
+        // scheduler keeps 8 slots busy and refills them as items finish, so a
+        // larger queue only leaves stragglers at the end of each call.
+        private const val INFERENCE_BATCH_SIZE = 32
+
+        // Restrict native generation to the allergen label grammar
+        private const val GRAMMAR_CONSTRAINED = true
+
+        // Score the nine labels in one native pass instead of generating text
+        private const val USE_SCORING_MODE = false
+
+        // Native decode/prefill thread counts; 0 lets the engine pick from the CPU layout
+        private const val DECODE_THREADS = 0
+
+        private const val PREFILL_THREADS = 0
+
+        // Requests that may run at once on a shared model; each extra context costs KV memory
+        private const val CONTEXT_POOL_SIZE = 1
+
+        // Native KV cache type: 0 f16, 1 q8_0 (about half the KV memory), 2 q4_0
+        private const val KV_CACHE_TYPE = 0
+
+        // Requantize bundled models once into the weight format ggml repacks for this CPU and
+        // run them in place of the selected file. Off by default: the Q4_K_M -> Q4_0 requantization
+        // changes accuracy and writes a second model file; results record the weights used
+        private const val OPTIMIZE_MODELS = false
+
+        // Native trim levels: free KV caches and cached prefixes, or also unload models
+        private const val NATIVE_TRIM_MODERATE = 1
+
+        private const val NATIVE_TRIM_CRITICAL = 2
+
+        // Model weights after load: 0 lazy, 1 madvise WILLNEED, 2 also prefault every page
+        private const val RESIDENCY_MODE = 1
+
+        // mlock the weights when they fit twice into available memory (usually refused on Android)
+        private const val LOCK_MODEL_IF_FITS = false
+
+        // Sweep native thread/batch settings in the background once each model has preloaded;
+        // predictions use the defaults until a tuned config exists and preempt a sweep holding their lane
+        private const val AUTO_TUNE = true
+
+        // Native job states (see JobState in engine.h)
+        private const val JOB_QUEUED = 0
+
+        private const val JOB_RUNNING = 1
+
+        // Job state and progress sampling interval, which also caps progress UI updates
+        private const val JOB_POLL_MS = 100L
+
+        // Partial-output listeners of streaming jobs, keyed by job id
+        private val streamListeners = ConcurrentHashMap<Long, (String) -> Unit>()
+
+        // Called by the native stream thread with coalesced partial output
+        @JvmStatic
+        fun onNativeStream(jobId: Long, item: Int, partial: String, percent: Int, done: Boolean) {
+
+            streamListeners[jobId]?.invoke(partial)
+
+        }
+
+        // Receives native model preload progress while MainActivity is alive
+        @Volatile
+        private var modelLoadListener: ((String, Int, Boolean, Boolean) -> Unit)? = null
+
+        // Called by the native preload thread; `ok` is only meaningful once `done`
+        @JvmStatic
+        fun onModelLoad(modelPath: String, percent: Int, done: Boolean, ok: Boolean) {
+
+            modelLoadListener?.invoke(modelPath, percent, done, ok)
+
+        }
+
+        // Receives the outcome of native background requantization while MainActivity is alive
+        @Volatile
+        private var modelOptimizedListener: ((String, String) -> Unit)? = null
+
+        // Called by the native requantization thread; `variantPath` is empty when none was built
+        @JvmStatic
+        fun onModelOptimized(modelPath: String, variantPath: String) {
+
+            modelOptimizedListener?.invoke(modelPath, variantPath)
+
+        }
+
         init {
 
             System.loadLibrary("native-lib")
@@ -63,7 +159,45 @@ class MainActivity : AppCompatActivity() {
 
 // --- JNI Definition (Must match C++ signature exactly) ---
 
-    external fun inferAllergens(input: String, modelPath: String, reportProgress: Boolean): String
+    external fun inferAllergens(input: String, modelPath: String, reportProgress: Boolean): NativeResult
+
+    external fun inferAllergensBatch(inputs: Array<String>, modelPath: String): Array<NativeResult>
+
+    external fun scoreAllergens(input: String, modelPath: String): NativeResult
+
+    external fun setModelCacheBudget(budgetBytes: Long)
+
+    external fun setStateCacheDir(dir: String)
+
+    external fun preloadModel(modelPath: String)
+
+    external fun optimizeModel(modelPath: String)
+
+    external fun setUseOptimizedVariants(enabled: Boolean)
+
+    external fun setGrammarConstrained(enabled: Boolean)
+
+    external fun setThreadConfig(decodeThreads: Int, prefillThreads: Int, contextPoolSize: Int)
+
+    external fun setKvCacheType(type: Int)
+
+    external fun setResidencyPolicy(mode: Int, lockIfFits: Boolean, hugepages: Boolean)
+
+    external fun trimNativeMemory(level: Int): Long
+
+    external fun tuneModel(modelPath: String, force: Boolean): String
+
+    external fun submitInference(inputs: Array<String>, modelPath: String, scoring: Boolean, stream: Boolean): Long
+
+    external fun pollJob(jobId: Long): Int
+
+    external fun jobProgress(jobId: Long): Int
+
+    external fun cancelJob(jobId: Long): Boolean
+
+    external fun cancelAllJobs()
+
+    external fun awaitJob(jobId: Long, timeoutMs: Long): Array<NativeResult>?
 
 
 
@@ -91,6 +225,12 @@ class MainActivity : AppCompatActivity() {
 
     private lateinit var spinnerModel: Spinner
 
+    // Set while the progress views show a background model preload
+    private var preloadOwnsProgress = false
+
+    // Model paths already handed to optimizeModel in this activity (UI thread only)
+    private val optimizeRequested = HashSet<String>()
+
     private lateinit var tvDatasetInfo: TextView
 
     private lateinit var btnLoadDataset: Button
@@ -160,6 +300,8 @@ class MainActivity : AppCompatActivity() {
 
         checkAndRequestPermissions()
 
+        configureModelCache()
+
 
 
 // Load CSV Data
@@ -208,12 +350,17 @@ class MainActivity : AppCompatActivity() {
 
                 if (assets?.contains(modelName) == true) {
 
+                    // Copy to a temporary file and rename, so an interrupted copy is never taken for the model
+                    val partFile = File(context.filesDir, "$modelName.part")
+
                     context.assets.open(modelName).use { input ->
 
-                        outFile.outputStream().use { output -> input.copyTo(output) }
+                        partFile.outputStream().use { output -> input.copyTo(output) }
 
                     }
 
+                    if (!partFile.renameTo(outFile)) throw IOException("Cannot rename ${partFile.name}")
+
                     Log.d("MODEL", "Copied $modelName")
 
                     outFile.absolutePath
@@ -257,6 +404,8 @@ class MainActivity : AppCompatActivity() {
 
                 btnPredictItem.isEnabled = false
 
+                preloadOwnsProgress = false
+
             }
 
 
@@ -273,8 +422,6 @@ class MainActivity : AppCompatActivity() {
 
                 }
 
-
-
                 val prompt = buildPrompt(item.ingredients)
 
 
@@ -293,7 +440,12 @@ class MainActivity : AppCompatActivity() {
 
 // This takes time, which is fine (generating text)
 
-                val rawResult = inferAllergens(prompt, modelPath, true)
+                val nativeResult = runNativeJob(
+                    arrayOf(prompt),
+                    modelPath,
+                    onProgress = { updateNativeProgress(it) },
+                    onPartial = { showPartialOutput(it) }
+                )[0]
 
 
 
@@ -307,11 +459,11 @@ class MainActivity : AppCompatActivity() {
 
 
 
-                val (predicted, cppMetrics) = parseRawResult(rawResult)
+                val (predicted, cppMetrics) = parseNativeResult(nativeResult)
 
 
 
-                val finalMetrics = InferenceMetrics(
+                val finalMetrics = cppMetrics.copy(
 
                     latencyMs = latencyMs,
 
@@ -319,15 +471,7 @@ class MainActivity : AppCompatActivity() {
 
                     nativeHeapKb = nativeAfter - nativeBefore,
 
-                    totalPssKb = pssAfter - pssBefore,
-
-                    ttft = cppMetrics.ttft,
-
-                    itps = cppMetrics.itps,
-
-                    otps = cppMetrics.otps,
-
-                    oet = cppMetrics.oet
+                    totalPssKb = pssAfter - pssBefore
 
                 )
 
@@ -429,6 +573,7 @@ class MainActivity : AppCompatActivity() {
                 progressBar.progress = 0
                 tvProgress.visibility = View.VISIBLE
                 tvProgress.text = "Initializing $batchName..."
+                preloadOwnsProgress = false
                 predictionResults.clear()
             }
 
@@ -453,80 +598,94 @@ class MainActivity : AppCompatActivity() {
             var totalTtft = 0.0; var totalOtps = 0.0; var totalItps = 0.0
             var totalOet = 0.0; var totalJavaHeap = 0.0; var totalNativeHeap = 0.0; var totalPss = 0.0
             var validSamples = 0; var successCount = 0; var failCount = 0
+            // Native footprint: the largest value reported by any item
+            var maxModelKb = 0L; var maxPeakRssKb = 0L
 
-            // 2. Loop through the GENERIC list of items
-            for ((index, item) in items.withIndex()) {
+            // 2. Loop through the GENERIC list of items, INFERENCE_BATCH_SIZE prompts per native call
+            for ((chunkIndex, chunk) in items.chunked(INFERENCE_BATCH_SIZE).withIndex()) {
+                val firstIndex = chunkIndex * INFERENCE_BATCH_SIZE
                 withContext(Dispatchers.Main) {
-                    val percent = ((index.toFloat() / items.size) * 100).toInt()
+                    val percent = ((firstIndex.toFloat() / items.size) * 100).toInt()
                     progressBar.progress = percent
-                    tvProgress.text = "Processing ${index + 1}/${items.size}: ${item.name}"
+                    tvProgress.text = "Processing ${firstIndex + 1}-${firstIndex + chunk.size}/${items.size}: ${chunk.first().name}"
                 }
 
-                try {
-                    val prompt = buildPrompt(item.ingredients)
-
-                    // Memory & Time Capture
-                    val javaBefore = MemoryReader.javaHeapKb()
-                    val nativeBefore = MemoryReader.nativeHeapKb()
-                    val pssBefore = MemoryReader.totalPssKb()
-                    val startNs = System.nanoTime()
-
-                    // Inference
-                    val rawResult = inferAllergens(prompt, modelPath, false)
-
-                    // Metrics Calculation
-                    val latencyMs = (System.nanoTime() - startNs) / 1_000_000
-                    val javaDiff = MemoryReader.javaHeapKb() - javaBefore
-                    val nativeDiff = MemoryReader.nativeHeapKb() - nativeBefore
-                    val pssDiff = MemoryReader.totalPssKb() - pssBefore
-
-                    val (predictedStr, cppMetrics) = parseRawResult(rawResult)
-                    val metrics = MetricsCalculator.calculate(item.allergensMapped, predictedStr)
-
-                    // Accumulate Data
-                    totalPrecision += metrics.precision
-                    totalRecall += metrics.recall
-                    totalF1 += metrics.f1Score
-                    totalLatency += latencyMs
-                    if (metrics.exactMatch) totalEmrCount++
-                    totalHamming += metrics.hammingLoss
-                    totalFnr += metrics.falseNegativeRate
-
-                    if (metrics.isOverPrediction) overPredictionCount++
-                    if (metrics.isHallucination) hallucinationCount++
-                    if (metrics.isAbstentionCase) {
-                        abstentionTotalCount++
-                        if (metrics.isAbstentionSuccess) abstentionCorrectCount++
-                    }
-
-                    totalTtft += cppMetrics.ttft
-                    totalOtps += cppMetrics.otps
-                    totalItps += cppMetrics.itps
-                    totalOet += cppMetrics.oet
-                    totalJavaHeap += javaDiff
-                    totalNativeHeap += nativeDiff
-                    totalPss += pssDiff
-                    validSamples++
-
-                    val finalMetrics = InferenceMetrics(
-                        latencyMs, javaDiff, nativeDiff, pssDiff,
-                        cppMetrics.ttft, cppMetrics.itps, cppMetrics.otps, cppMetrics.oet
-                    )
-
-                    val result = PredictionResult(
-                        foodItem = item,
-                        predictedAllergens = predictedStr,
-                        modelName = selectedModelFilename,
-                        metrics = finalMetrics
-                    )
-                    results.add(result)
-                    successCount++
-
-                    notificationManager.showProgressNotification(index + 1, items.size, item.name)
+                // Memory & Time Capture (shared by every item in the chunk)
+                val javaBefore = MemoryReader.javaHeapKb()
+                val nativeBefore = MemoryReader.nativeHeapKb()
+                val pssBefore = MemoryReader.totalPssKb()
+                val startNs = System.nanoTime()
 
+                // Inference: all prompts of the chunk are decoded together
+                val nativeResults = try {
+                    val prompts = chunk.map { buildPrompt(it.ingredients) }
+                    runNativeJob(prompts.toTypedArray(), modelPath)
+                } catch (e: CancellationException) {
+                    throw e
                 } catch (e: Exception) {
-                    failCount++
-                    Log.e("BATCH", "Failed on item ${item.name}", e)
+                    Log.e("BATCH", "Failed on chunk starting at ${chunk.first().name}", e)
+                    failCount += chunk.size
+                    continue
+                }
+
+                // Metrics Calculation (latency is amortized over the chunk)
+                val latencyMs = (System.nanoTime() - startNs) / 1_000_000 / chunk.size
+                val javaDiff = MemoryReader.javaHeapKb() - javaBefore
+                val nativeDiff = MemoryReader.nativeHeapKb() - nativeBefore
+                val pssDiff = MemoryReader.totalPssKb() - pssBefore
+
+                for ((offset, item) in chunk.withIndex()) {
+                    try {
+                        val (predictedStr, cppMetrics) = parseNativeResult(nativeResults[offset])
+                        val metrics = MetricsCalculator.calculate(item.allergensMapped, predictedStr)
+
+                        // Accumulate Data
+                        totalPrecision += metrics.precision
+                        totalRecall += metrics.recall
+                        totalF1 += metrics.f1Score
+                        totalLatency += latencyMs
+                        if (metrics.exactMatch) totalEmrCount++
+                        totalHamming += metrics.hammingLoss
+                        totalFnr += metrics.falseNegativeRate
+
+                        if (metrics.isOverPrediction) overPredictionCount++
+                        if (metrics.isHallucination) hallucinationCount++
+                        if (metrics.isAbstentionCase) {
+                            abstentionTotalCount++
+                            if (metrics.isAbstentionSuccess) abstentionCorrectCount++
+                        }
+
+                        totalTtft += cppMetrics.ttft
+                        totalOtps += cppMetrics.otps
+                        totalItps += cppMetrics.itps
+                        totalOet += cppMetrics.oet
+                        totalJavaHeap += javaDiff
+                        totalNativeHeap += nativeDiff
+                        totalPss += pssDiff
+                        maxModelKb = maxOf(maxModelKb, cppMetrics.modelKb)
+                        maxPeakRssKb = maxOf(maxPeakRssKb, cppMetrics.peakRssKb)
+                        validSamples++
+
+                        val finalMetrics = cppMetrics.copy(
+                            latencyMs = latencyMs, javaHeapKb = javaDiff,
+                            nativeHeapKb = nativeDiff, totalPssKb = pssDiff
+                        )
+
+                        val result = PredictionResult(
+                            foodItem = item,
+                            predictedAllergens = predictedStr,
+                            modelName = selectedModelFilename,
+                            metrics = finalMetrics
+                        )
+                        results.add(result)
+                        successCount++
+
+                        notificationManager.showProgressNotification(firstIndex + offset + 1, items.size, item.name)
+
+                    } catch (e: Exception) {
+                        failCount++
+                        Log.e("BATCH", "Failed on item ${item.name}", e)
+                    }
                 }
             }
 
@@ -564,7 +723,10 @@ class MainActivity : AppCompatActivity() {
                     abstentionAccuracy = abstentionAccuracy, hallucinationRate = hallucinationRate, overPredictionRate = overPredictionRate,
                     avgLatency = avgLatency, avgTotalTime = avgLatency,
                     avgTtft = avgTtft, avgItps = avgItps, avgOtps = avgOtps, avgOet = avgOet,
-                    avgJavaHeap = avgJavaHeap / 1024.0, avgNativeHeap = avgNativeHeap / 1024.0, avgPss = avgPss / 1024.0
+                    avgJavaHeap = avgJavaHeap / 1024.0, avgNativeHeap = avgNativeHeap / 1024.0, avgPss = avgPss / 1024.0,
+                    modelMb = maxModelKb / 1024.0, peakRssMb = maxPeakRssKb / 1024.0,
+                    weightsFormat = results.mapNotNull { it.metrics?.weightsFormat }.distinct()
+                        .joinToString("+").ifEmpty { "original" }
                 )
             } catch (e: Exception) {
                 Log.e("BATCH", "Failed to save benchmark summary", e)
@@ -585,82 +747,59 @@ class MainActivity : AppCompatActivity() {
     }
 
 
-    private fun parseRawResult(rawResult: String): Pair<String, InferenceMetrics> {
-
-        val parts = rawResult.split("|", limit = 2)
+    // Labels are decoded natively into labelMask, so the output text is only logged
+    private fun parseNativeResult(result: NativeResult): Pair<String, InferenceMetrics> {
 
-        val meta = parts[0]
+        result.error?.let { throw IllegalStateException("Native inference failed: $it") }
 
-        val rawOutput = if (parts.size > 1) parts[1] else ""
 
 
+        Log.d("DEBUG_MODEL", "Model Raw Output: ${result.outputText()}")
 
-        Log.d("DEBUG_MODEL", "Model Raw Output: $rawOutput")
 
 
+        return Pair(
 
-        var ttft = 0L; var itps = 0L; var otps = 0L; var oet = 0L
+            result.labels(),
 
-        meta.split(";").forEach {
+            InferenceMetrics(
 
-            when {
+                0, 0, 0, 0, result.ttftMs, result.itps, result.otps, result.oetMs,
 
-                it.startsWith("TTFT_MS=") -> ttft = it.removePrefix("TTFT_MS=").toLongOrNull() ?: 0L
+                prefillUs = result.prefillUs, decodeUs = result.decodeUs,
 
-                it.startsWith("ITPS=") -> itps = it.removePrefix("ITPS=").toLongOrNull() ?: 0L
+                sampleUs = result.sampleUs, detokenizeUs = result.detokenizeUs,
 
-                it.startsWith("OTPS=") -> otps = it.removePrefix("OTPS=").toLongOrNull() ?: 0L
+                itlP50Us = result.itlP50Us, itlP95Us = result.itlP95Us, itlMaxUs = result.itlMaxUs,
 
-                it.startsWith("OET_MS=") -> oet = it.removePrefix("OET_MS=").toLongOrNull() ?: 0L
-
-            }
-
-        }
+                perfPromptUs = result.perfPromptUs, perfEvalUs = result.perfEvalUs,
 
+                modelKb = result.modelBytes / 1024, modelResidentKb = result.modelResidentBytes / 1024,
 
+                rssKb = result.rssBytes / 1024, peakRssKb = result.peakRssBytes / 1024,
 
-        val cleanedString = rawOutput
+                weightsFormat = result.weightsFormat ?: "original", weightsPath = result.weightsPath ?: ""
 
-            .replace("Assistant:", "", ignoreCase = true)
+            )
 
-            .replace("System:", "", ignoreCase = true)
-
-            .replace("User:", "", ignoreCase = true)
-
-            .lowercase()
-
-
-
-        val allowedAllergens = setOf(
-
-            "milk", "egg", "peanut", "tree nut",
+        )
 
-            "wheat", "soy", "fish", "shellfish", "sesame"
+    }
 
-        )
 
-        val detectedSet = mutableSetOf<String>()
 
-        for (allergen in allowedAllergens) {
+    private fun showPartialOutput(partial: String) {
 
-            val regex = "\\b${Regex.escape(allergen)}\\b".toRegex()
+        runOnUiThread {
 
-            if (regex.containsMatchIn(cleanedString)) {
+            if (progressBar.visibility == View.VISIBLE && !btnPredictItem.isEnabled) {
 
-                detectedSet.add(allergen)
+                tvProgress.text = "Generating: ${progressBar.progress}%\n$partial"
 
             }
 
         }
 
-
-
-        val finalAllergens = detectedSet.joinToString(", ").ifEmpty { "EMPTY" }
-
-
-
-        return Pair(finalAllergens, InferenceMetrics(0, 0, 0, 0, ttft, itps, otps, oet))
-
     }
 
 
@@ -729,6 +868,7 @@ class MainActivity : AppCompatActivity() {
         spinnerModel.onItemSelectedListener = object : AdapterView.OnItemSelectedListener {
             override fun onItemSelected(p0: AdapterView<*>?, p1: View?, pos: Int, p3: Long) {
                 selectedModelFilename = modelsList[pos]
+                preloadSelectedModel()
             }
             override fun onNothingSelected(p0: AdapterView<*>?) {}
         }
@@ -876,6 +1016,8 @@ class MainActivity : AppCompatActivity() {
         5. NEVER include explanations, preambles, or extra text.
     """.trimIndent()
 
+        // Native code caches the prompt up to and including "Ingredients to analyze:\n"
+        // (the prefix boundary in engine.cpp); keep that text verbatim
         val userMsg = "Ingredients to analyze:\n$ingredients"
 
         // 2. FORMAT SECTION:
@@ -912,6 +1054,250 @@ class MainActivity : AppCompatActivity() {
 
 
 
+    // Run prompts as a native job. Cancelling the calling coroutine (e.g. when the
+    // activity is destroyed) aborts the job's in-flight decode. onPartial receives
+    // the output decoded so far, in chunks coalesced by the native side. onProgress
+    // is sampled once per JOB_POLL_MS and only called when the percentage changed.
+    private suspend fun runNativeJob(
+        prompts: Array<String>,
+        modelPath: String,
+        onProgress: ((Int) -> Unit)? = null,
+        onPartial: ((String) -> Unit)? = null
+    ): Array<NativeResult> {
+
+        val jobId = submitInference(prompts, modelPath, USE_SCORING_MODE, onPartial != null)
+
+        if (onPartial != null) streamListeners[jobId] = onPartial
+
+        var lastProgress = -1
+
+        try {
+
+            while (pollJob(jobId) in JOB_QUEUED..JOB_RUNNING) {
+
+                if (onProgress != null) {
+
+                    val progress = jobProgress(jobId)
+
+                    if (progress != lastProgress) {
+
+                        lastProgress = progress
+
+                        onProgress(progress)
+
+                    }
+
+                }
+
+                delay(JOB_POLL_MS)
+
+            }
+
+        } catch (e: CancellationException) {
+
+            cancelJob(jobId)
+
+            awaitJob(jobId, -1)
+
+            throw e
+
+        } finally {
+
+            streamListeners.remove(jobId)
+
+        }
+
+        return awaitJob(jobId, -1) ?: throw IllegalStateException("Native job $jobId not found")
+
+    }
+
+
+
+    override fun onDestroy() {
+
+        // Stop native work that was started for this activity
+        cancelAllJobs()
+
+        modelLoadListener = null
+
+        modelOptimizedListener = null
+
+        super.onDestroy()
+
+    }
+
+
+
+    // Give native memory back before the system kills the process mid-batch.
+    // Models, contexts and cached prefixes are rebuilt by the next request.
+    @Suppress("DEPRECATION")
+    override fun onTrimMemory(level: Int) {
+
+        super.onTrimMemory(level)
+
+        val nativeLevel = when (level) {
+
+            ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL,
+            ComponentCallbacks2.TRIM_MEMORY_COMPLETE -> NATIVE_TRIM_CRITICAL
+
+            ComponentCallbacks2.TRIM_MEMORY_RUNNING_MODERATE,
+            ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW,
+            ComponentCallbacks2.TRIM_MEMORY_BACKGROUND,
+            ComponentCallbacks2.TRIM_MEMORY_MODERATE -> NATIVE_TRIM_MODERATE
+
+            else -> return
+
+        }
+
+        val released = trimNativeMemory(nativeLevel)
+
+        Log.i("MEMORY", "onTrimMemory($level): released $released native bytes")
+
+    }
+
+
+
+    override fun onLowMemory() {
+
+        super.onLowMemory()
+
+        trimNativeMemory(NATIVE_TRIM_CRITICAL)
+
+    }
+
+
+
+    // Tune once per (model, device) off the UI thread; later calls return the
+    // persisted config immediately, and a preempted sweep is retried at the next preload
+    private fun tuneInBackground(modelPath: String) {
+
+        if (!AUTO_TUNE) return
+
+        lifecycleScope.launch(Dispatchers.Default) {
+
+            val summary = tuneModel(modelPath, false)
+
+            Log.d("TUNE", summary)
+
+        }
+
+    }
+
+
+
+    // Keep loaded models resident across predictions, up to half of device RAM
+    private fun configureModelCache() {
+
+        val memInfo = ActivityManager.MemoryInfo()
+
+        (getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager).getMemoryInfo(memInfo)
+
+        setModelCacheBudget(memInfo.totalMem / 2)
+
+
+
+// Persist the decoded system prompt so the first prediction after launch skips its prefill
+
+        val stateDir = File(filesDir, "prompt_cache").apply { mkdirs() }
+
+        setStateCacheDir(stateDir.absolutePath)
+
+        setGrammarConstrained(GRAMMAR_CONSTRAINED)
+
+        setThreadConfig(DECODE_THREADS, PREFILL_THREADS, CONTEXT_POOL_SIZE)
+
+        setKvCacheType(KV_CACHE_TYPE)
+
+        setResidencyPolicy(RESIDENCY_MODE, LOCK_MODEL_IF_FITS, false)
+
+        setUseOptimizedVariants(OPTIMIZE_MODELS)
+
+    }
+
+
+
+    // Load and warm up the selected model in the background, so the first
+    // prediction does not pay for it. Progress is shown only while no
+    // prediction is using the progress views.
+    private fun preloadSelectedModel() {
+
+        val modelName = selectedModelFilename
+
+        modelLoadListener = { path, percent, done, ok ->
+
+            runOnUiThread {
+
+                if (!done) {
+
+                    if (tvProgress.visibility != View.VISIBLE) preloadOwnsProgress = true
+
+                    if (preloadOwnsProgress) {
+
+                        progressBar.visibility = View.VISIBLE
+
+                        progressBar.progress = percent
+
+                        tvProgress.visibility = View.VISIBLE
+
+                        tvProgress.text = "Loading Model... $percent%"
+
+                    }
+
+                } else {
+
+                    if (preloadOwnsProgress) hideProgress()
+
+                    preloadOwnsProgress = false
+
+                    Log.d("MODEL", "Preload of $path ${if (ok) "finished" else "failed or superseded"}")
+
+                    if (ok) tuneInBackground(path)
+
+                }
+
+            }
+
+        }
+
+        modelOptimizedListener = { path, variant ->
+
+            runOnUiThread {
+
+                Log.d("MODEL", if (variant.isEmpty()) "No optimized variant of $path" else "Optimized variant of $path: $variant")
+
+                // Load and warm up the variant before the next prediction needs it
+                if (variant.isNotEmpty() && File(path).name == selectedModelFilename) {
+
+                    preloadModel(path)
+
+                }
+
+            }
+
+        }
+
+        lifecycleScope.launch {
+
+            val modelPath = copyModelToInternalStorage(this@MainActivity, modelName)
+
+            if (modelPath.isNotEmpty() && modelName == selectedModelFilename) {
+
+                preloadModel(modelPath)
+
+                if (OPTIMIZE_MODELS && optimizeRequested.add(modelPath)) {
+
+                    optimizeModel(modelPath)
+
+                }
+
+            }
+
+        }
+
+    }
+
+
+
     private fun hideProgress() {
 
         progressBar.visibility = View.GONE
@@ -0,0 +1,90 @@
+// NativeResult.kt
+package edu.utem.ftmk.slm02
+
+/**
+ * Result of one native inference. Instances are created and filled in by
+ * native-lib.cpp through field IDs cached in JNI_OnLoad, so the fields must
+ * stay plain JVM fields and keep their names and types.
+ */
+class NativeResult {
+
+    // Set when the prompt failed; the other fields are then unset
+    @JvmField var error: String? = null
+
+    @JvmField var ttftMs: Long = -1
+
+    @JvmField var itps: Long = 0
+
+    @JvmField var otps: Long = 0
+
+    @JvmField var oetMs: Long = 0
+
+    @JvmField var generatedTokens: Int = 0
+
+    @JvmField var slot: Int = 0
+
+    // Phase timings in microseconds
+    @JvmField var ttftUs: Long = -1
+
+    @JvmField var prefillUs: Long = 0
+
+    @JvmField var decodeUs: Long = 0
+
+    @JvmField var sampleUs: Long = 0
+
+    @JvmField var detokenizeUs: Long = 0
+
+    @JvmField var totalUs: Long = 0
+
+    // Inter-token latency distribution, in microseconds
+    @JvmField var itlP50Us: Long = 0
+
+    @JvmField var itlP95Us: Long = 0
+
+    @JvmField var itlMaxUs: Long = 0
+
+    // llama.cpp's own prompt/eval timers for the native run this result came from
+    @JvmField var perfPromptUs: Long = 0
+
+    @JvmField var perfEvalUs: Long = 0
+
+    // Native memory footprint in bytes when the result was produced
+    @JvmField var modelBytes: Long = 0
+
+    @JvmField var modelResidentBytes: Long = 0
+
+    @JvmField var rssBytes: Long = 0
+
+    @JvmField var peakRssBytes: Long = 0
+
+    // Bit i set for ALLERGEN_LABELS[i]
+    @JvmField var labelMask: Int = 0
+
+    // Scoring mode only: P(yes) per label
+    @JvmField var labelProbs: FloatArray? = null
+
+    // GGUF file that served the prompt, and its optimized variant format
+    // (null when the selected model file itself was used)
+    @JvmField var weightsPath: String? = null
+
+    @JvmField var weightsFormat: String? = null
+
+    // Raw model output as UTF-8 bytes
+    @JvmField var output: ByteArray = ByteArray(0)
+
+    fun outputText(): String = String(output, Charsets.UTF_8)
+
+    // Detected labels as "a, b", or EMPTY
+    fun labels(): String =
+        ALLERGEN_LABELS.filterIndexed { i, _ -> labelMask and (1 shl i) != 0 }
+            .joinToString(", ")
+            .ifEmpty { "EMPTY" }
+
+    companion object {
+        // Bitmask order, same as ALLERGEN_LABELS in engine.h
+        val ALLERGEN_LABELS = listOf(
+            "milk", "egg", "peanut", "tree nut",
+            "wheat", "soy", "fish", "shellfish", "sesame"
+        )
+    }
+}
@@ -11,4 +11,11 @@ data class PredictionResult(
     val timestamp: Long = System.currentTimeMillis(),
     val metrics: InferenceMetrics? = null,
     val firestoreId: String = ""
-) : Parcelable
\ No newline at end of file
+) : Parcelable {
+
+    // Model name as shown to the user, naming an optimized variant when one was used
+    fun modelLabel(): String {
+        val format = metrics?.weightsFormat ?: "original"
+        return if (format == "original") modelName else "$modelName ($format variant)"
+    }
+}
\ No newline at end of file